@@ -0,0 +1,4 @@
+C_CC := gcc
+C_DEBUG := 0
+C_GCC32 := 0
+C_USELTO := 1
@@ -64,7 +64,11 @@ typedef enum xmlError
     /* Unexpected character found while parsing,
      * offending character in xmlDocErrChar(),
      * position in xmlDocLine() and xmlDocColumn() */
-    XML_UNEXPECTED
+    XML_UNEXPECTED,
+
+    /* the allocator returned 0, the document is incomplete and
+     * rootElement() returns 0, no info */
+    XML_NOMEM
 } XmlError;
 
 /* represents the whole XML document */
@@ -76,10 +80,172 @@ typedef struct XmlAttribute XmlAttribute;
 /* represents an XML element (tag) */
 typedef struct XmlElement XmlElement;
 
+/* table of interned tag and attribute names, see xmlInternName() */
+typedef struct XmlNameTable XmlNameTable;
+
+/* functions managing memory, see xmlSetAllocator() */
+typedef struct XmlAllocator
+{
+    /* get a block of size bytes, aligned for any type, or 0 if there is
+     * no memory left. Running out of memory fails what needed it: parsing
+     * (also building content of a lazily parsed document) with XML_NOMEM,
+     * functions returning something new return 0 (or -1 as an error). */
+    void *(*alloc)(void *ctx, size_t size);
+
+    /* resize the block p of oldSize bytes to size bytes, keeping its
+     * content, and return it (possibly moved). If there is no memory left,
+     * return 0 and leave p alone. */
+    void *(*resize)(void *ctx, void *p, size_t oldSize, size_t size);
+
+    /* release the block p of size bytes */
+    void (*release)(void *ctx, void *p, size_t size);
+
+    /* passed to the functions */
+    void *ctx;
+} XmlAllocator;
+
+/* statistics of a document, see XmlParseOptions.stats and xmlDocStats() */
+typedef struct XmlStats
+{
+    /* bytes of XML text scanned, content built lazily counts again */
+    size_t bytes;
+
+    /* elements, attributes and pieces of text content built */
+    size_t elements;
+    size_t attributes;
+    size_t texts;
+
+    /* deepest nesting of elements built, the root element is at 1 */
+    size_t maxDepth;
+
+    /* memory allocated for the document and temporarily while parsing:
+     * number of allocations, their total size and the most bytes that
+     * were allocated at once. Names in a shared XmlNameTable don't count. */
+    size_t allocations;
+    size_t allocated;
+    size_t peakLive;
+
+    /* seconds spent scanning the text, building the tree (including
+     * deciding what to build with XmlParseOptions.keep) and in freeDoc(),
+     * only measured with XmlParseOptions.timing */
+    double scanTime;
+    double buildTime;
+    double freeTime;
+} XmlStats;
+
+/* options for parseDocWith(), members that are 0 select the default */
+typedef struct XmlParseOptions
+{
+    /* store names in this table instead of one owned by the document. It
+     * can be shared by many documents (but not by parses running at the
+     * same time) and must outlive all of them. */
+    XmlNameTable *names;
+
+    /* nonzero: build elements lazily. Parsing only builds the root element
+     * and skips its content, checking just that tags are balanced. The
+     * children and content of an element are built when they are first
+     * reached (e.g. by firstChild(), elementContent() or findMatching()),
+     * again skipping the content of the children. xmlText must stay valid
+     * and unchanged as long as the document is used, and the document
+     * changes when read, so it can't be shared between threads. An error
+     * found later is reported by xmlDocError() and rootElement() returns 0
+     * from then on. Which error is found first depends on the order
+     * content is built in, see also xmlValidateAll(). */
+    int lazy;
+
+    /* list of paths, terminated by 0, selecting the elements to build.
+     * Paths are like for xmlCompileQuery(), but must be absolute and can't
+     * have predicates. A selected element is built with its whole subtree,
+     * and its ancestors are built with their attributes but without
+     * content. The root element is always built. All other elements are
+     * skipped, only checking that their tags are balanced. lazy is
+     * ignored. parseDocWith() returns 0 (with errno set to EINVAL) if a
+     * path isn't valid. Example: { "/feed/entry/title", "//price", 0 } */
+    const char *const *keep;
+
+    /* collect statistics of the document in stats, which must stay valid
+     * until freeDoc() returned. They are complete after parsing, except for
+     * content built lazily later and the time freeDoc() takes. Without
+     * stats, nothing is counted. */
+    XmlStats *stats;
+
+    /* nonzero: also measure the time of the phases in stats. This reads
+     * the clock twice for every node, so it makes parsing a lot slower. */
+    int timing;
+
+    /* get the memory of the document, and what parsing it needs
+     * temporarily, from allocator instead of the global one set with
+     * xmlSetAllocator(). It is copied, but the memory it hands out must
+     * stay valid until freeDoc(). */
+    const XmlAllocator *allocator;
+} XmlParseOptions;
+
+
+/* get all memory from allocator, or from malloc(), realloc() and free()
+ * if it is 0 (the default). The allocator is copied. Documents and other
+ * objects keep using the allocator they were created with, but this must
+ * not be called while other threads use badxml. The result of xmlText()
+ * is always from malloc(). */
+void xmlSetAllocator(const XmlAllocator *allocator);
 
 /* parse xmlText as XML, return as XML document */
 XmlDoc *parseDoc(const char *xmlText);
 
+/* parse len bytes of xmlText as XML, xmlText doesn't need to be terminated
+ * and is never read beyond len. */
+XmlDoc *parseDocN(const char *xmlText, size_t len);
+
+/* parse the file at path as XML. The file is mapped to memory for parsing
+ * instead of being read into a buffer. Returns 0 (with errno set) if the
+ * file can't be opened or mapped. */
+XmlDoc *parseFile(const char *path);
+
+/* parse len bytes in buf as XML without copying names and values: they are
+ * terminated inside buf, so buf is modified and must stay alive (and
+ * unchanged) as long as the returned document is used. */
+XmlDoc *parseDocInPlace(char *buf, size_t len);
+
+/* like parseDocN(), with options (which may be 0) */
+XmlDoc *parseDocWith(const char *xmlText, size_t len,
+	const XmlParseOptions *options);
+
+/* like parseDocN(), using up to nthreads threads for large documents. The
+ * content of the root element is split between its children, so this helps
+ * with documents having many children of the root. The result, including
+ * errors, is the same as from parseDocN(); on errors the document is parsed
+ * again serially to find the first one. */
+XmlDoc *parseDocParallel(const char *xmlText, size_t len, int nthreads);
+
+/* called for every document of xmlParseBatchNotify() as soon as it is
+ * parsed, with its index in the batch. Calls come from the parsing threads,
+ * possibly at the same time and in any order. The document belongs to the
+ * callback. */
+typedef void (*XmlBatchCallback)(void *ctx, size_t index, XmlDoc *doc);
+
+/* parse n documents using up to nthreads threads, out[i] receives the
+ * document parsed from texts[i]. With lens, texts[i] has lens[i] bytes
+ * (like parseDocN()), if lens is 0, all texts are terminated. Returns when
+ * all documents are parsed. Meant for many small documents, the threads
+ * only live for one call. */
+void xmlParseBatch(const char **texts, const size_t *lens, size_t n,
+	XmlDoc **out, int nthreads);
+
+/* like xmlParseBatch(), passing every document to callback instead, so it
+ * can be processed while others are still parsed */
+void xmlParseBatchNotify(const char **texts, const size_t *lens, size_t n,
+	int nthreads, XmlBatchCallback callback, void *ctx);
+
+/* create and destroy a name table to share between documents.
+ * xmlNameTableNew() returns 0 if memory ran out. */
+XmlNameTable *xmlNameTableNew(void);
+void xmlNameTableFree(XmlNameTable *names);
+
+/* get the interned copy of name from the name table of doc, adding it if
+ * it isn't there yet. All tag and attribute names in the document are
+ * interned, so the result can be compared to tagName() and
+ * attributeName() by pointer. Returns 0 if memory ran out. */
+const char *xmlInternName(XmlDoc *doc, const char *name);
+
 /* get result of parsing (XML_SUCCESS or an error code */
 XmlError xmlDocError(const XmlDoc *doc);
 
@@ -95,9 +261,24 @@ long xmlDocLine(const XmlDoc *doc);
 /* get column position of an error */
 long xmlDocColumn(const XmlDoc *doc);
 
-/* get root element of the document, or 0 if there was an error */
+/* get root element of the document, or 0 if there was an error. For a
+ * lazily parsed document, that includes an error found later while
+ * building content. */
 XmlElement *rootElement(const XmlDoc *doc);
 
+/* check the parts of a lazily parsed document that weren't built yet,
+ * without building them, in document order. An error already found while
+ * building content is kept and returned without checking further, so it
+ * depends on the order content was built in and isn't necessarily the
+ * first one in the text. Returns the error (also reported by xmlDocError()
+ * from now on), or XML_SUCCESS. */
+XmlError xmlValidateAll(XmlDoc *doc);
+
+/* update the statistics of doc (if it was parsed with
+ * XmlParseOptions.stats) and copy them to stats. Returns 0, or -1 if no
+ * statistics were collected for doc. */
+int xmlDocStats(const XmlDoc *doc, XmlStats *stats);
+
 /* format error message and print to file
  * (use stderr for printing to console) */
 void xmlDocPerror(const XmlDoc *doc, FILE *file, const char *fmt, ...);
@@ -106,6 +287,22 @@ void xmlDocPerror(const XmlDoc *doc, FILE *file, const char *fmt, ...);
  * must be called when finished with the XML data. */
 void freeDoc(XmlDoc *doc);
 
+/* empty doc (from any of the functions returning one) for reuse, as if it
+ * was parsed from "". Its memory is kept, up to the limit set with
+ * xmlDocSetRetainLimit(), and used again by the next parseDocInto(). So
+ * parsing similar documents into the same doc doesn't allocate memory for
+ * the tree once there is enough. The allocator, a shared name table and
+ * collecting statistics (see XmlParseOptions) stay with doc. */
+void xmlDocReset(XmlDoc *doc);
+
+/* reset doc and parse len bytes of xmlText into it, like parseDocN().
+ * Returns the result, also reported by xmlDocError(). */
+XmlError parseDocInto(XmlDoc *doc, const char *xmlText, size_t len);
+
+/* keep at most bytes of memory for reuse when doc is reset, so one big
+ * document doesn't pin all of its memory (default 1MB) */
+void xmlDocSetRetainLimit(XmlDoc *doc, size_t bytes);
+
 /* navigation in the document */
 XmlElement *firstChild(const XmlElement *element);
 XmlElement *lastChild(const XmlElement *element);
@@ -123,11 +320,116 @@ XmlElement *parentElement(const XmlElement *element);
 XmlElement *findMatching(const XmlElement *element,
         const char *tagname, const char *attname, const char *attval);
 
+/* state for finding all elements matching like findMatching(), usually
+ * on the stack. Its members are private. */
+typedef struct XmlMatchIter
+{
+    const XmlElement *top;
+    const XmlElement *next;
+    const char *tagname;
+    const char *attname;
+    const char *attval;
+} XmlMatchIter;
+
+/* start iterating over all elements below and including element that
+ * match like with findMatching(). The strings must stay valid while the
+ * iterator is used. */
+XmlMatchIter xmlMatchBegin(const XmlElement *element,
+	const char *tagname, const char *attname, const char *attval);
+
+/* get the next matching element in document order, or 0 when done.
+ * Enumerating all matches visits every element once. */
+XmlElement *xmlMatchNext(XmlMatchIter *it);
+
+/* store up to max next matches in results, returns how many were stored
+ * (less than max only when done) */
+size_t xmlMatchNextN(XmlMatchIter *it, XmlElement **results, size_t max);
+
+/* like findMatching(), but tagname and attname must be results of
+ * xmlInternName() for the element's document and are compared by pointer
+ * only, which is a lot faster than comparing strings. */
+XmlElement *findMatchingInterned(const XmlElement *element,
+        const char *tagname, const char *attname, const char *attval);
+
+/* indexes for xmlBuildIndex() */
+typedef enum xmlIndexFlags
+{
+    /* index elements by tag name */
+    XML_INDEX_TAGS = 1,
+
+    /* index elements by attribute name and value */
+    XML_INDEX_ATTRIBUTES = 2
+} XmlIndexFlags;
+
+/* build indexes for xmlIndexLookup() and xmlFindById(), replacing earlier
+ * ones. Building walks the document once, O(elements + attributes), taking
+ * roughly as long as parsing for XML_INDEX_ATTRIBUTES and a third of that
+ * for XML_INDEX_TAGS. The memory becomes part of the document and is
+ * released by freeDoc(). Per indexed element or attribute, it is one
+ * pointer. Per distinct tag name or distinct attribute name/value pair,
+ * it is a 48 byte key plus 2 to 4 hash slots of one pointer each (sizes
+ * for 64bit systems). So an index of unique ids takes 70 to 90 bytes per
+ * id attribute. Scratch memory of about the same size is needed while
+ * building. Returns -1 if the document has no root element or memory ran
+ * out, keeping the earlier indexes. */
+int xmlBuildIndex(XmlDoc *doc, int flags);
+
+/* find all elements (in document order) with the given tag name that have
+ * an attribute attname with value attval ("" matches an empty value). Each
+ * of tagname, attname and attval may be 0 to match anything. Unlike
+ * findMatching(), an element without attributes never matches an
+ * attname. Stores up to max elements in results and returns the number of
+ * all matches. Uses the attribute index for attname and attval, the tag
+ * index otherwise, and scans the whole document if the index needed
+ * wasn't built. */
+size_t xmlIndexLookup(const XmlDoc *doc, const char *tagname,
+	const char *attname, const char *attval,
+	XmlElement **results, size_t max);
+
+/* first element with an attribute id of value id, or 0 */
+XmlElement *xmlFindById(const XmlDoc *doc, const char *id);
+
+/* a compiled path query */
+typedef struct XmlQuery XmlQuery;
+
+/* compile a path query, returns 0 (with errno set to EINVAL) if path isn't
+ * valid, or with errno ENOMEM if memory ran out. Supported is a subset of
+ * XPath: steps separated by / (child) or // (descendant), each a tag name
+ * or * followed by any number of predicates [@att='value'] (or with double
+ * quotes), [@att] (attribute present) and [n] (position among the children
+ * of the same parent passing the predicates before it, starting at 1). A
+ * path starting with / starts at the root element (its first step matches
+ * the root), otherwise at the children of the element the query is run
+ * on. At most 30 steps and 16 predicates per step are allowed. A compiled
+ * query doesn't belong to a document and can be run on any number of
+ * them, also from several threads at once.
+ * Example: /config/servers/server[@role='primary']/port */
+XmlQuery *xmlCompileQuery(const char *path);
+
+/* free a compiled query */
+void xmlFreeQuery(XmlQuery *query);
+
+/* run query on context, calling callback with ctx for every matching
+ * element in document order. The callback may return non-zero to stop.
+ * Returns the number of matches found (callback may be 0 to only count
+ * them), or (size_t)-1 if memory ran out. The document is walked once,
+ * skipping subtrees where nothing can match. */
+size_t xmlQueryRun(const XmlQuery *query, const XmlElement *context,
+	int (*callback)(void *ctx, XmlElement *element), void *ctx);
+
 /* navigate attribute list of an element */
 XmlAttribute *firstAttribute(const XmlElement *element);
 XmlAttribute *nextAttribute(const XmlAttribute *attribute);
 XmlElement *attributeElement(const XmlAttribute *attribute);
 
+/* the first attribute of element named name, or 0 if there is none. The
+ * N variant takes a name of len bytes that needn't be terminated. Elements
+ * with many attributes keep a hash table of them, so this is constant time
+ * for those, a walk of the (short) list otherwise. */
+XmlAttribute *xmlGetAttribute(const XmlElement *element, const char *name);
+XmlAttribute *xmlGetAttributeN(const XmlElement *element, const char *name,
+	size_t len);
+
 /* getters. The elementContent() gets the whole text (including tags) between
  * opening and closing tag of the element. */
 const char *tagName(const XmlElement *element);
@@ -135,8 +437,123 @@ const char *elementContent(const XmlElement *element);
 const char *attributeName(const XmlAttribute *attribute);
 const char *attributeValue(const XmlAttribute *attribute);
 
+/* the source of an element (from its opening tag to the end of its closing
+ * tag) or of an attribute (name to the end of the value) in the parsed
+ * text, with its length in len. Nothing is copied, so the text must still
+ * be valid. Returns 0 if the document doesn't point into its text, because
+ * it was parsed in place, by a push parser or loaded from a binary image. */
+const char *xmlElementSource(const XmlElement *element, size_t *len);
+const char *xmlAttributeSource(const XmlAttribute *attribute, size_t *len);
+
+/* line of source, a position in the text doc was parsed from (e.g. from
+ * xmlElementSource()), with its column in column if that isn't 0. Returns
+ * 0 if source isn't in the text. Lines are counted on every call. */
+long xmlNodeLine(const XmlDoc *doc, const char *source, long *column);
+
+/* the document as XML text, one element per line and indented by nesting
+ * depth (like xmlWrite() with XML_WRITE_PRETTY). The result is allocated
+ * with malloc() and must be freed by the caller. Returns 0 if the document
+ * has no root element or memory ran out. */
 char *xmlText(const XmlDoc *doc);
 
+/* destination for xmlWrite(), set up by one of the functions below */
+typedef struct XmlSink
+{
+    int (*write)(void *ctx, const char *data, size_t len);
+    void *ctx;
+    int fd;
+} XmlSink;
+
+/* write to a stdio stream */
+void xmlFileSink(XmlSink *sink, FILE *file);
+
+/* write to a file descriptor (using writev() where available) */
+void xmlFdSink(XmlSink *sink, int fd);
+
+/* pass the output to write, called with ctx and the next len bytes of
+ * output. It must return 0 on success, anything else stops writing. */
+void xmlCallbackSink(XmlSink *sink,
+	int (*write)(void *ctx, const char *data, size_t len), void *ctx);
+
+/* flags for xmlWrite() */
+typedef enum xmlWriteFlags
+{
+    /* one element per line, indented by nesting depth */
+    XML_WRITE_PRETTY = 0,
+
+    /* no whitespace added between elements */
+    XML_WRITE_COMPACT = 1
+} XmlWriteFlags;
+
+/* write the document as XML text to sink. Output is collected in a small
+ * fixed buffer and passed on in pieces, so the whole text never has to fit
+ * in memory. Returns 0, or -1 if the document has no root element,
+ * writing failed (with errno set for file and fd sinks) or memory ran out
+ * building lazily parsed content (errno ENOMEM). */
+int xmlWrite(const XmlDoc *doc, XmlSink *sink, int flags);
+
+/* save the document as a binary image at path. Loading it again with
+ * xmlLoadBinary() is much faster than parsing. Returns 0, or -1 if the
+ * document has no root element, memory ran out or writing failed (with
+ * errno set). */
+int xmlSaveBinary(const XmlDoc *doc, const char *path);
+
+/* load a binary image saved by xmlSaveBinary(). The file is mapped to
+ * memory and its nodes are used in place, only pages holding nodes are
+ * copied. Images are only valid for the same library version and the same
+ * platform (pointer size and byte order), and carry a checksum. Returns 0
+ * (with errno set) if the file can't be read or memory ran out, or with
+ * errno EINVAL if it is not a valid image for this library, so it should
+ * be rebuilt from the XML source. Whether the image is older than its
+ * source is up to the caller to check. */
+XmlDoc *xmlLoadBinary(const char *path);
+
+/* callbacks for xmlParseEvents(), each of them may be 0.
+ * Names, values and text are passed as pointer and length without a
+ * terminating NUL, only valid during the call. */
+typedef struct XmlHandler
+{
+    /* opening tag, attributes of this element follow */
+    void (*startElement)(void *ctx, const char *name, size_t nameLen);
+
+    /* attribute of the last started element, valueLen is 0 for an
+     * empty value */
+    void (*attribute)(void *ctx, const char *name, size_t nameLen,
+	    const char *value, size_t valueLen);
+
+    /* text inside the current element, only reported if it isn't just
+     * whitespace and with trailing whitespace stripped (the pieces
+     * elementContent() is built from) */
+    void (*text)(void *ctx, const char *text, size_t len);
+
+    /* closing tag or end of an empty element */
+    void (*endElement)(void *ctx, const char *name, size_t nameLen);
+} XmlHandler;
+
+/* parse len bytes of xmlText as XML, reporting its structure to the
+ * callbacks in handler (passing ctx to them) instead of building a tree.
+ * Returns a document holding only the result (rootElement() is always 0),
+ * errors are reported exactly like with parseDoc(). */
+XmlDoc *xmlParseEvents(const char *xmlText, size_t len,
+	const XmlHandler *handler, void *ctx);
+
+/* parser for XML arriving in chunks of any size */
+typedef struct XmlPushParser XmlPushParser;
+
+/* create a push parser. With a handler, the structure is reported to its
+ * callbacks like with xmlParseEvents(), otherwise a document tree is built.
+ */
+XmlPushParser *xmlPushParserNew(const XmlHandler *handler, void *ctx);
+
+/* parse the next n bytes of input, chunk isn't needed any more when this
+ * returns. Returns XML_SUCCESS or the error parsing stopped at, further
+ * input is ignored after an error. */
+XmlError xmlPushFeed(XmlPushParser *p, const char *chunk, size_t n);
+
+/* signal the end of input and destroy the parser. Returns the document,
+ * with the tree if the parser was created without handler. */
+XmlDoc *xmlPushFinish(XmlPushParser *p);
+
 #ifdef BADXML_DEBUG
 /* for debugging: dump document structure to file (typically stderr) */
 void dumpDoc(const XmlDoc *doc, FILE *file);
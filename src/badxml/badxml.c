@@ -1,15 +1,236 @@
+#ifndef WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <badxml/badxml.h>
 
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
+#include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+	&& !defined(BADXML_NO_SIMD)
+#define BADXML_X86SIMD
+#include <immintrin.h>
+#endif
+
+#ifdef WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+/* all nodes and strings of a document are carved out of a list of large
+ * chunks owned by the document, so freeing a document only has to release
+ * these chunks. */
+#define ARENA_FIRSTCHUNK 4096
+#define ARENA_MAXCHUNK (1024 * 1024)
+
+/* default for xmlDocSetRetainLimit() */
+#define DOC_RETAIN (1024 * 1024)
+
+typedef union arenaAlign
+{
+    void *p;
+    long l;
+    double d;
+} arenaAlign;
+
+#define ARENA_ALIGNED(n) \
+    (((n) + sizeof(arenaAlign) - 1) & ~(sizeof(arenaAlign) - 1))
+
+struct arenaChunk
+{
+    struct arenaChunk *next;
+    size_t size;
+    size_t used;
+    arenaAlign data[1];
+};
+
+struct arena
+{
+    struct arenaChunk *chunks;
+    char *last;
+
+    /* chunks kept by xmlDocReset() for reuse */
+    struct arenaChunk *spare;
+    XmlAllocator allocator;
+};
+
+/* length and capacity of the content of an open element, text between its
+ * children is appended there */
+struct valueBuilder
+{
+    size_t len;
+    size_t size;
+};
+
+/* tag and attribute names are interned: every distinct name is stored once
+ * and all elements and attributes using it point to the same string */
+struct nameEntry
+{
+    const char *name;
+    size_t len;
+    unsigned long hash;
+};
+
+struct XmlNameTable
+{
+    struct arena *arena;
+    struct nameEntry *entries;
+    size_t size;
+    size_t count;
+    struct arena ownArena;
+};
+
+struct indexEntry;
+
+/* hash table of keys, slots hold the key index + 1 */
+struct xmlIndex
+{
+    struct indexEntry *keys;
+    size_t count;
+    size_t *slots;
+    size_t size;
+};
+
+/* statistics of a document parsed with XmlParseOptions.stats. Counters
+ * go straight to the caller's XmlStats, the memory of the document is
+ * found from its arena chunks when needed. */
+struct docStats
+{
+    XmlStats *out;
+    int timing;
+
+    /* temporary buffers of the tokenizers */
+    size_t tempAllocs;
+    size_t tempBytes;
+    size_t tempPeak;
+};
+
+/* hash table of the attributes of an element having many of them, by
+ * name. Only the first of several attributes with the same name is in the
+ * table, dups is set then. Slots hold the position in the row + 1, as the
+ * row may move while it grows. */
+#define ATTTABLE_MIN 16
+
+struct attTable
+{
+    size_t size;
+    size_t count;
+    int dups;
+    size_t slots[1];
+};
+
+/* elements are stored in blocks: arrays holding a subtree in document
+ * order, so the first child of an element directly follows it. Parsing
+ * builds the main block, content built later by materialize() gets a block
+ * of its own. The array is preceded by a pointer to its block. */
+#define BLOCK_HEAD ARENA_ALIGNED(sizeof(struct nodeBlock *))
+#define BLOCK_FIRST 32
+
+/* the opening tag of an element to the end of its closing tag, and the
+ * number of attributes before its own in the block */
+struct elementSpan
+{
+    const char *start;
+    const char *end;
+    size_t firstAtt;
+};
+
+/* the name of an attribute to the end of its value */
+struct attSpan
+{
+    const char *start;
+    const char *end;
+};
+
+struct nodeBlock
+{
+    XmlElement *elements;
+    size_t count;
+    size_t size;
+
+    /* source spans of the elements and, in document order, of the
+     * attributes. Without spans these are 0. */
+    struct elementSpan *spans;
+    struct attSpan *attSpans;
+    size_t natts;
+    size_t attsSize;
+
+    /* the elements moved while building, finishBlock() points attributes
+     * to their new place */
+    int moved;
+
+    /* the elements are part of a binary image */
+    int image;
+    size_t allocs;
+    size_t allocated;
+    struct nodeBlock *next;
+};
+
+#define elementBlock(e) \
+    (((struct nodeBlock *const *)(const void *)((e) - (e)->index))[-1])
 
 struct XmlDoc
 {
+    struct arena arena;
+
+    /* attribute rows are kept apart from text, so the row of the current
+     * element can grow in place */
+    struct arena rows;
+    XmlNameTable ownNames;
+    XmlNameTable *names;
     XmlElement *root;
-    const char *currLine;
-    union {
+    struct nodeBlock *blocks;
+
+    /* elements are added to build, as children of the element at index
+     * current - 1 (none if current is 0) */
+    struct nodeBlock *build;
+    size_t current;
+
+    /* arrays of a block kept by xmlDocReset() for reuse */
+    struct nodeBlock spare;
+
+    /* hashes of the names of the first attributes of current, for building
+     * its table when it gets ATTTABLE_MIN of them */
+    unsigned long attHashes[ATTTABLE_MIN];
+    struct xmlIndex tagIndex;
+    struct xmlIndex attIndex;
+    struct valueBuilder *values;
+    size_t valuesSize;
+    char *image;
+    size_t imageSize;
+    size_t retain;
+    const char *text;
+    const char *end;
+    long textLine;
+    long lineCarry;
+    char *term;
+
+    /* newlines overwritten by terminators, the last one ending before
+     * termLine */
+    long termLines;
+    const char *termLine;
+    int inPlace;
+
+    /* nodes record where they are in text, unless it's only available in
+     * chunks or changed by parsing in place. tagEnd is the end of the tag
+     * closing the current element. */
+    int spans;
+    const char *tagEnd;
+    struct docStats *stats;
+    union xmlErrInfo {
 	char c;
 	char *s;
     } errInfo;
@@ -18,732 +239,5687 @@ struct XmlDoc
     long col;
 };
 
+/* the attributes of an element are a row in doc->rows */
 struct XmlAttribute
 {
     char *name;
     char *value;
     XmlElement *parent;
-    XmlAttribute *prev;
-    XmlAttribute *next;
 };
 
+/* links between elements are 32bit distances within their block, so an
+ * element takes 48 bytes on 64bit systems */
+#define NODE_MAXDEPTH 0x1fffffffU
+
 struct XmlElement
 {
     char *name;
     char *value;
-    XmlElement *parent;
-    XmlElement *prev;
-    XmlElement *next;
+
+    /* row of natts attributes, preceded by their table if there are
+     * ATTTABLE_MIN or more */
     XmlAttribute *attributes;
-    XmlElement *children;
-    unsigned int depth;
+
+    /* back to the parent, ahead to the next sibling and to the last child,
+     * 0 if there is none */
+    unsigned int parent;
+    unsigned int next;
+    unsigned int last;
+    unsigned int index;
+    unsigned int natts;
+    unsigned int depth : 29;
+    unsigned int lazy : 1;
+
+    /* stands in for the element in value as the parent of its children
+     * built later */
+    unsigned int stub : 1;
+
+    /* the children were built later, value is the struct lazyContent */
+    unsigned int external : 1;
 };
 
-struct stringBuilder
+#define ATTTABLE_HEAD ARENA_ALIGNED(sizeof(struct attTable *))
+#define attTableOf(e) ((e)->natts >= ATTTABLE_MIN \
+	? ((struct attTable *const *)(const void *)(e)->attributes)[-1] : 0)
+
+/* content of an element not built yet, found in value while lazy is set.
+ * Once built with children, it holds the content and the stand-in for the
+ * element. */
+struct lazyContent
 {
-    char *buf;
-    char *bufp;
-    char *endp;
-    size_t bufsize;
+    XmlDoc *doc;
+    const char *start;
+    const char *end;
+    char *value;
+    XmlElement *children;
 };
 
-static void sbInit(struct stringBuilder *sb)
+#define MATERIALIZE(e) \
+    do { if ((e)->lazy) materialize((XmlElement *)(e)); } while (0)
+
+static void materialize(XmlElement *e);
+
+static XmlElement *
+childOf(const XmlElement *e)
 {
-    sb->buf = malloc(1024);
-    sb->bufp = sb->buf;
-    sb->endp = sb->buf + 1024;
-    *sb->bufp = '\0';
-    sb->bufsize = 1024;
+    if (e->external)
+    {
+	e = ((const struct lazyContent *)(const void *)e->value)->children;
+    }
+    return e->last ? (XmlElement *)e + 1 : 0;
 }
 
-static void sbAppend(struct stringBuilder *sb, const char *s)
+static XmlElement *
+lastChildOf(const XmlElement *e)
 {
-    while (*s)
+    if (e->external)
     {
-	*sb->bufp++ = *s++;
-	if (sb->bufp == sb->endp)
-	{
-	    sb->buf = realloc(sb->buf, sb->bufsize * 2);
-	    sb->bufp = sb->buf + sb->bufsize;
-	    sb->bufsize *= 2;
-	    sb->endp = sb->buf + sb->bufsize;
-	}
+	e = ((const struct lazyContent *)(const void *)e->value)->children;
     }
-    *sb->bufp = '\0';
+    return e->last ? (XmlElement *)e + e->last : 0;
 }
 
-static char *
-cloneString(const char *s)
+static XmlElement *
+nextOf(const XmlElement *e)
 {
-    char *cpy = malloc(strlen(s)+1);
-    strcpy(cpy, s);
-    return cpy;
+    return e->next ? (XmlElement *)e + e->next : 0;
 }
 
-static void
-skipWs(XmlDoc *doc, const char **pos)
+static XmlElement *
+parentOf(const XmlElement *e)
 {
-    while (isspace(**pos))
-    {
-	if (**pos == '\n')
-	{
-	    ++(doc->line);
-	    doc->currLine = ++(*pos);
-	}
-	else ++(*pos);
-    }
+    const XmlElement *p;
+
+    if (!e->parent) return 0;
+    p = e - e->parent;
+    return p->stub ? (XmlElement *)(void *)p->value : (XmlElement *)p;
 }
 
-static void
-skipUntil(XmlDoc *doc, const char **pos, char endmark)
+static const char *
+contentOf(const XmlElement *e)
 {
-    while (**pos && **pos != endmark)
+    if (e->external)
     {
-	if (**pos == '\n')
-	{
-	    ++(doc->line);
-	    doc->currLine = ++(*pos);
-	}
-	else ++(*pos);
+	return ((const struct lazyContent *)(const void *)e->value)->value;
     }
+    return e->value;
 }
 
-static int
-hasNonWs(const char *start, const char *end)
+/* all memory comes from an XmlAllocator, by default from the C library.
+ * Blocks are released with their size, so allocators don't need to store
+ * it. */
+static void *
+stdAlloc(void *ctx, size_t size)
 {
-    while (start != end) if (!isspace(*start++)) return 1;
-    return 0;
+    (void)ctx;
+    return malloc(size);
 }
 
-static void
-appendString(char **s, const char *src, size_t *ssize, size_t n)
+static void *
+stdResize(void *ctx, void *p, size_t oldSize, size_t size)
 {
-    if (*ssize)
-    {
-	*ssize += n;
-	*s = realloc(*s, *ssize);
-    }
-    else
-    {
-	*ssize = n+1;
-	*s = malloc(*ssize);
-	**s = '\0';
-    }
-    strncat(*s, src, n);
+    (void)ctx;
+    (void)oldSize;
+    return realloc(p, size);
 }
 
-#define FAIL(x) \
-    do { doc->err = (x); goto fail; } while(0)
-#define FAILS(x, es) \
-    do { doc->err = (x); doc->errInfo.s = (es); goto fail; } while (0)
-#define FAILC(x, ec) \
-    do { doc->err = (x); doc->errInfo.c = (ec); goto fail; } while (0)
-
-static char *
-readBareWord(const char **pos, const char* endmarks)
+static void
+stdRelease(void *ctx, void *p, size_t size)
 {
-    const char *start;
-    char *word;
+    (void)ctx;
+    (void)size;
+    free(p);
+}
 
-    start = *pos;
+static const XmlAllocator stdAllocator = {
+    stdAlloc,
+    stdResize,
+    stdRelease,
+    0
+};
 
-    if (!*start) return 0;
-    while (!isspace(**pos) && **pos)
-    {
-	const char *testend = endmarks;
-	while (*testend) if (**pos == *testend++) goto end;
-	++(*pos);
-    }
-       
-end:
-    if (*pos == start) return 0;
+/* set by xmlSetAllocator() */
+static XmlAllocator globalAllocator = {
+    stdAlloc,
+    stdResize,
+    stdRelease,
+    0
+};
 
-    word = calloc(1, (size_t)(*pos - start) + 1);
-    memcpy(word, start, (size_t)(*pos - start));
-    return word;
+static void *
+allocMem(const XmlAllocator *a, size_t size)
+{
+    return a->alloc(a->ctx, size);
 }
 
-static void
-freeAttributeListStep(XmlAttribute *first, XmlAttribute *attribute)
+static void *
+resizeMem(const XmlAllocator *a, void *p, size_t oldSize, size_t size)
 {
-    if (attribute->next != first) freeAttributeListStep(first, attribute->next);
-    free(attribute->value);
-    free(attribute->name);
-    free(attribute);
+    if (!p) return a->alloc(a->ctx, size);
+    return a->resize(a->ctx, p, oldSize, size);
 }
 
 static void
-freeAttributeList(XmlAttribute *first)
+releaseMem(const XmlAllocator *a, void *p, size_t size)
 {
-    if (first) freeAttributeListStep(first, first);
+    if (p) a->release(a->ctx, p, size);
 }
 
-static void freeElementList(XmlElement *first);
+/* a document uses the allocator its arena was created with */
+#define docAllocator(doc) (&(doc)->arena.allocator)
+
 static void
-freeElementListStep(XmlElement *first, XmlElement *element)
+arenaInit(struct arena *a, const XmlAllocator *allocator)
 {
-    freeElementList(element->children);
-    freeAttributeList(element->attributes);
-    if (element->next != first) freeElementListStep(first, element->next);
-    free(element->value);
-    free(element->name);
-    free(element);
+    a->chunks = 0;
+    a->last = 0;
+    a->spare = 0;
+    a->allocator = allocator ? *allocator : globalAllocator;
 }
 
-static void
-freeElementList(XmlElement *first)
+static struct arenaChunk *
+arenaNewChunk(struct arena *a, size_t size)
 {
-    if (first) freeElementListStep(first, first);
+    size_t chunkSize = a->chunks ? a->chunks->size * 2 : ARENA_FIRSTCHUNK;
+    struct arenaChunk **spare;
+    struct arenaChunk *chunk;
+
+    for (spare = &a->spare; *spare; spare = &(*spare)->next)
+    {
+	if ((*spare)->size < size) continue;
+	chunk = *spare;
+	*spare = chunk->next;
+	chunk->next = a->chunks;
+	a->chunks = chunk;
+	return chunk;
+    }
+
+    if (chunkSize > ARENA_MAXCHUNK) chunkSize = ARENA_MAXCHUNK;
+    if (chunkSize < size) chunkSize = size;
+    chunk = allocMem(&a->allocator,
+	    offsetof(struct arenaChunk, data) + chunkSize);
+    if (!chunk) return 0;
+    chunk->next = a->chunks;
+    chunk->size = chunkSize;
+    chunk->used = 0;
+    a->chunks = chunk;
+    return chunk;
 }
 
-void
-freeDoc(XmlDoc *doc)
+/* size bytes, or 0 if memory ran out */
+static void *
+arenaAlloc(struct arena *a, size_t size)
 {
-    if (doc)
+    struct arenaChunk *chunk = a->chunks;
+    char *p;
+
+    size = ARENA_ALIGNED(size);
+    if (!chunk || chunk->size - chunk->used < size)
     {
-	freeElementList(doc->root);
-	if (doc->err == XML_UNMATCHEDCLOSE || doc->err == XML_CLOSEWOOPEN)
-	{
-	    free(doc->errInfo.s);
-	}
-	free(doc);
+	if (!(chunk = arenaNewChunk(a, size))) return 0;
     }
+    p = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    a->last = p;
+    return p;
 }
 
-static XmlAttribute *
-parseAttribute(XmlDoc *doc, const char **xmlText, XmlElement *element)
+/* grow the block p (from arenaAlloc()) from oldsize to newsize bytes, this
+ * is done in place if p is the most recent allocation and still fits */
+static void *
+arenaGrow(struct arena *a, void *p, size_t oldsize, size_t newsize)
 {
-    const char *startval;
-    XmlAttribute *attribute = calloc(1, sizeof(XmlAttribute));
-    attribute->next = attribute->prev = attribute;
-    attribute->parent = element;
+    struct arenaChunk *chunk = a->chunks;
+    void *grown;
 
-    attribute->name = readBareWord(xmlText, "=");
-    if (!attribute->name) FAIL(XML_UNNAMEDATTR);
-    if (!**xmlText) FAIL(XML_EOF);
-    skipWs(doc, xmlText);
-    if (**xmlText != '=') FAILC(XML_UNEXPECTED, **xmlText);
-    ++(*xmlText);
-    skipWs(doc, xmlText);
-    if (**xmlText == '"' || **xmlText == '\'')
+    if (p && p == a->last)
     {
-	++(*xmlText);
-	startval = *xmlText;
-	skipUntil(doc, xmlText, *(*xmlText-1));
-	if (!**xmlText) FAIL(XML_EOF);
-	if (*xmlText - startval)
+	size_t used = (size_t)(a->last - (char *)chunk->data);
+	if (chunk->size - used >= ARENA_ALIGNED(newsize))
 	{
-	    attribute->value = calloc(1, (size_t)(*xmlText - startval) + 1);
-	    memcpy(attribute->value, startval, (size_t)(*xmlText - startval));
+	    chunk->used = used + ARENA_ALIGNED(newsize);
+	    return p;
 	}
-	++(*xmlText);
-	return attribute;
     }
-    else
+    if ((grown = arenaAlloc(a, newsize)) && oldsize)
     {
-	attribute->value = readBareWord(xmlText, "/>");
-	if (!**xmlText) FAIL(XML_EOF);
-	return attribute;
+	memcpy(grown, p, oldsize);
     }
-
-fail:
-    doc->col = *xmlText - doc->currLine + 1;
-    freeAttributeList(attribute);
-    return 0;
+    return grown;
 }
 
-static XmlElement *
-parseElement(XmlDoc *doc, const char **xmlText, XmlElement *parent)
+static void
+releaseChunks(const XmlAllocator *allocator, struct arenaChunk *chunk)
 {
-    XmlElement *element = 0;
-    XmlElement *childnode = 0;
-    XmlAttribute *attribute = 0;
-    const char *startval = 0;
-    const char *endval = 0;
-    size_t valLen = 0;
+    struct arenaChunk *next;
 
-    ++(*xmlText);
-    if (!**xmlText) FAIL(XML_EOF);
-    if (**xmlText == '/')
+    while (chunk)
     {
-	++(*xmlText);
-	FAILS(XML_CLOSEWOOPEN, readBareWord(xmlText, ">"));
+	next = chunk->next;
+	releaseMem(allocator, chunk,
+		offsetof(struct arenaChunk, data) + chunk->size);
+	chunk = next;
     }
+}
+
+static void
+arenaFree(struct arena *a)
+{
+    /* a may live in one of its chunks */
+    XmlAllocator allocator = a->allocator;
+    struct arenaChunk *spare = a->spare;
+
+    releaseChunks(&allocator, a->chunks);
+    releaseChunks(&allocator, spare);
+}
+
+/* move all chunks of from behind the current chunk of a, so allocation
+ * from a continues where it was */
+static void
+arenaJoin(struct arena *a, struct arena *from)
+{
+    struct arenaChunk *chunk;
 
-    element = calloc(1, sizeof(XmlElement));
-    element->prev = element->next = element;
-    element->parent = parent;
-    if (parent)
+    if (!from->chunks) return;
+    if (a->chunks)
     {
-	element->depth = parent->depth + 1;
+	for (chunk = from->chunks; chunk->next; chunk = chunk->next);
+	chunk->next = a->chunks->next;
+	a->chunks->next = from->chunks;
     }
     else
     {
-	element->depth = 0;
+	a->chunks = from->chunks;
+	a->last = from->last;
     }
-    element->name = readBareWord(xmlText, ">");
-    if (!element->name) FAIL(XML_UNNAMEDTAG);
-    if (!**xmlText) FAIL(XML_EOF);
+    from->chunks = 0;
+}
 
-    while (1)
-    {
-	skipWs(doc, xmlText);
-	if (!**xmlText) FAIL(XML_EOF);
+/* empty a, keeping only the chunk keep (if not 0) in use. The other chunks
+ * become spare as long as they fit in *budget bytes, the rest is
+ * released. */
+static void
+arenaRecycle(struct arena *a, struct arenaChunk *keep, size_t *budget)
+{
+    struct arenaChunk *chunk = a->chunks;
+    struct arenaChunk *old = a->spare;
+    struct arenaChunk *spare = 0;
+    struct arenaChunk *next;
 
-	if (**xmlText == '>')
-	{
-	    ++(*xmlText);
-	    break;
-	}
-	if (**xmlText == '/')
-	{
-	    ++(*xmlText);
-	    skipWs(doc, xmlText);
-	    if (!**xmlText) FAIL(XML_EOF);
-	    if (**xmlText != '>') FAILC(XML_UNEXPECTED, **xmlText);
-	    ++(*xmlText);
-	    return element;
-	}
-	attribute = parseAttribute(doc, xmlText, element);
-	if (!attribute) goto failp;
-	if (element->attributes)
+    /* the chunks in use, then the old spare ones */
+    while (chunk || (chunk = old))
+    {
+	if (chunk == old) old = 0;
+	next = chunk->next;
+	if (chunk != keep && chunk->size <= *budget)
 	{
-	    attribute->prev = element->attributes->prev;
-	    attribute->next = element->attributes;
-	    element->attributes->prev->next = attribute;
-	    element->attributes->prev = attribute;
+	    *budget -= chunk->size;
+	    chunk->used = 0;
+	    chunk->next = spare;
+	    spare = chunk;
 	}
-	else
+	else if (chunk != keep)
 	{
-	    element->attributes = attribute;
+	    releaseMem(&a->allocator, chunk,
+		    offsetof(struct arenaChunk, data) + chunk->size);
 	}
-	attribute = 0;
-	if (!**xmlText) FAIL(XML_EOF);
+	chunk = next;
     }
+    if (keep) keep->next = 0;
+    a->chunks = keep;
+    a->last = 0;
+    a->spare = spare;
+}
 
-    startval = *xmlText;
-    while (**xmlText)
-    {
-	if (**xmlText == '<')
-	{
-	    if (hasNonWs(startval, *xmlText))
-	    {
-		endval = *xmlText;
-		while (isspace(*(endval-1))) --endval;
-		appendString(&(element->value), startval, &valLen,
-			(size_t)(endval - startval));
-	    }
-	    if ((*xmlText)[1] == '/')
-	    {
-		*xmlText += 2;
-		skipWs(doc, xmlText);
-		if (!**xmlText) FAIL(XML_EOF);
-		if (strncmp(*xmlText, element->name, strlen(element->name)))
-		{
-		    FAILS(XML_UNMATCHEDCLOSE, cloneString(element->name));
-		}
-		*xmlText += strlen(element->name);
-		skipWs(doc, xmlText);
-		if (!**xmlText) FAIL(XML_EOF);
-		if (**xmlText != '>') FAILC(XML_UNEXPECTED, **xmlText);
-		++(*xmlText);
-		return element;
-	    }
-	    else
-	    {
-		childnode = parseElement(doc, xmlText, element);
-		if (!childnode) goto failp;
-		if (element->children)
-		{
-		    childnode->prev = element->children->prev;
-		    childnode->next = element->children;
-		    element->children->prev->next = childnode;
-		    element->children->prev = childnode;
-		}
-		else
-		{
-		    element->children = childnode;
-		}
-		childnode = 0;
-		startval = *xmlText;
-	    }
-	}
-	else skipUntil(doc, xmlText, '<');
-    }
-    doc->err = XML_EOF;
+static char *
+arenaString(struct arena *a, const char *s, size_t n)
+{
+    char *cpy = arenaAlloc(a, n+1);
 
-fail:
-    doc->col = *xmlText - doc->currLine + 1;
-failp:
-    freeElementList(element);
-    return 0;
+    if (!cpy) return 0;
+    memcpy(cpy, s, n);
+    cpy[n] = '\0';
+    return cpy;
 }
 
-XmlDoc *
-parseDoc(const char *xmlText)
+static char *
+cloneString(XmlDoc *doc, const char *s, size_t n)
 {
-    XmlDoc* doc = malloc(sizeof(XmlDoc));
+    return arenaString(&doc->arena, s, n);
+}
 
-    doc->root = 0;
-    doc->err = XML_SUCCESS;
-    doc->line = 1;
+/* memory ran out while building doc, this fails the parse unless it
+ * already failed */
+static void
+noMem(XmlDoc *doc)
+{
+    if (doc->err == XML_SUCCESS) doc->err = XML_NOMEM;
+}
+
+static void
+releaseBlock(XmlDoc *doc, struct nodeBlock *b)
+{
+    const XmlAllocator *allocator = docAllocator(doc);
 
-    while(*xmlText)
+    if (b->elements && !b->image)
     {
-	if (*xmlText == '<')
-	{
-	    if (xmlText[1] == '!' || xmlText[1] == '?')
-	    {
-		++xmlText;
-		skipUntil(doc, &xmlText, '>');
-		if (!*xmlText)
-		{
-		    doc->err = XML_EOF;
-		    freeElementList(doc->root);
-		    doc->root = 0;
-		    return doc;
-		}
-		++xmlText;
-	    }
-	    else
-	    {
-		if (doc->root)
-		{
-		    doc->col = xmlText - doc->currLine + 1;
-		    doc->err = XML_SECONDROOT;
-		    freeElementList(doc->root);
-		    doc->root = 0;
-		    return doc;
-		}
-		else
-		{
-		    doc->root = parseElement(doc, &xmlText, 0);
-		    if (!doc->root) return doc;
-		}
-	    }
-	}
-	else if (isspace(*xmlText))
+	releaseMem(allocator, (char *)b->elements - BLOCK_HEAD,
+		BLOCK_HEAD + b->size * sizeof *b->elements);
+    }
+    releaseMem(allocator, b->spans, b->size * sizeof *b->spans);
+    releaseMem(allocator, b->attSpans, b->attsSize * sizeof *b->attSpans);
+}
+
+/* a new block, reusing the arrays kept by xmlDocReset(), or 0 if memory
+ * ran out */
+static struct nodeBlock *
+newBlock(XmlDoc *doc)
+{
+    const XmlAllocator *allocator = docAllocator(doc);
+    struct nodeBlock *b = arenaAlloc(&doc->arena, sizeof *b);
+
+    if (!b) return 0;
+    *b = doc->spare;
+    memset(&doc->spare, 0, sizeof doc->spare);
+    if (b->elements && doc->spans && !b->spans)
+    {
+	if ((b->spans = allocMem(allocator, b->size * sizeof *b->spans)))
 	{
-	    skipWs(doc, &xmlText);
+	    ++b->allocs;
+	    b->allocated += b->size * sizeof *b->spans;
 	}
 	else
 	{
-	    doc->col = xmlText - doc->currLine + 1;
-	    doc->err = XML_UNEXPECTED;
-	    doc->errInfo.c = *xmlText;
-	    freeElementList(doc->root);
-	    doc->root = 0;
-	    return doc;
+	    releaseBlock(doc, b);
+	    memset(b, 0, sizeof *b);
 	}
     }
-
-    return doc;
+    else if (b->elements && !doc->spans && b->spans)
+    {
+	releaseMem(allocator, b->spans, b->size * sizeof *b->spans);
+	releaseMem(allocator, b->attSpans, b->attsSize * sizeof *b->attSpans);
+	b->spans = 0;
+	b->attSpans = 0;
+	b->attsSize = 0;
+    }
+    if (b->elements) ((struct nodeBlock **)(void *)b->elements)[-1] = b;
+    b->next = doc->blocks;
+    doc->blocks = b;
+    return b;
 }
 
-XmlError
-xmlDocError(const XmlDoc *doc)
+/* resize the arrays for elements of a block to size, returns -1 and leaves
+ * them alone if memory ran out. The spans are copied to a new array, so
+ * both arrays always have the same size. */
+static int
+resizeBlock(XmlDoc *doc, struct nodeBlock *b, size_t size)
 {
-    return doc->err;
-}
+    const XmlAllocator *allocator = docAllocator(doc);
+    char *old = b->elements ? (char *)b->elements - BLOCK_HEAD : 0;
+    struct elementSpan *spans = 0;
+    char *mem;
 
-const char *
-xmlDocErrInfo(const XmlDoc *doc)
-{
-    if (doc->err == XML_UNMATCHEDCLOSE || doc->err == XML_CLOSEWOOPEN)
+    if (doc->spans && !(spans = allocMem(allocator, size * sizeof *spans)))
     {
-	return doc->errInfo.s;
+	return -1;
+    }
+    mem = resizeMem(allocator, old, BLOCK_HEAD + b->size * sizeof *b->elements,
+	    BLOCK_HEAD + size * sizeof *b->elements);
+    if (!mem)
+    {
+	releaseMem(allocator, spans, size * sizeof *spans);
+	return -1;
+    }
+    if (old && mem != old) b->moved = 1;
+    b->elements = (XmlElement *)(void *)(mem + BLOCK_HEAD);
+    ((struct nodeBlock **)(void *)b->elements)[-1] = b;
+    ++b->allocs;
+    b->allocated += BLOCK_HEAD + size * sizeof *b->elements;
+    if (spans)
+    {
+	if (b->count) memcpy(spans, b->spans, b->count * sizeof *spans);
+	releaseMem(allocator, b->spans, b->size * sizeof *b->spans);
+	b->spans = spans;
+	++b->allocs;
+	b->allocated += size * sizeof *spans;
     }
+    b->size = size;
     return 0;
 }
 
-char
-xmlDocErrChar(const XmlDoc *doc)
+/* append a span for a new attribute of the block, or 0 if memory ran out */
+static struct attSpan *
+addAttSpan(XmlDoc *doc, struct nodeBlock *b)
 {
-    if (doc->err == XML_UNEXPECTED) return doc->errInfo.c;
-    return 0;
-}
+    struct attSpan *spans;
+    size_t size;
 
-long
-xmlDocLine(const XmlDoc *doc)
-{
-    return doc->line;
+    if (b->natts == b->attsSize)
+    {
+	size = b->attsSize ? b->attsSize * 2 : BLOCK_FIRST;
+	spans = resizeMem(docAllocator(doc), b->attSpans,
+		b->attsSize * sizeof *b->attSpans, size * sizeof *b->attSpans);
+	if (!spans) return 0;
+	b->attSpans = spans;
+	++b->allocs;
+	b->allocated += size * sizeof *b->attSpans;
+	b->attsSize = size;
+    }
+    return b->attSpans + b->natts++;
 }
 
-long
-xmlDocColumn(const XmlDoc *doc)
+/* shrink the arrays of a block that is built to what is used, and point
+ * attributes to their elements if these moved */
+static void
+finishBlock(XmlDoc *doc, struct nodeBlock *b)
 {
-    return doc->col;
-}
+    const XmlAllocator *allocator = docAllocator(doc);
+    XmlElement *e, *end;
+    XmlAttribute *a, *aend;
+    struct attSpan *spans;
 
-XmlElement *
+    if (!b->count)
+    {
+	releaseBlock(doc, b);
+	b->elements = 0;
+	b->spans = 0;
+	b->attSpans = 0;
+	b->size = b->natts = b->attsSize = 0;
+	return;
+    }
+    /* if memory runs out even for this, the arrays keep their room */
+    if (b->count < b->size) resizeBlock(doc, b, b->count);
+    if (!b->natts)
+    {
+	releaseMem(allocator, b->attSpans, b->attsSize * sizeof *b->attSpans);
+	b->attSpans = 0;
+	b->attsSize = 0;
+    }
+    else if (b->natts < b->attsSize && (spans = resizeMem(allocator,
+		    b->attSpans, b->attsSize * sizeof *b->attSpans,
+		    b->natts * sizeof *b->attSpans)))
+    {
+	b->attSpans = spans;
+	++b->allocs;
+	b->allocated += b->natts * sizeof *b->attSpans;
+	b->attsSize = b->natts;
+    }
+    if (!b->moved) return;
+    for (e = b->elements, end = e + b->count; e != end; ++e)
+    {
+	for (a = e->attributes, aend = a + e->natts; a != aend; ++a)
+	{
+	    a->parent = e;
+	}
+    }
+    b->moved = 0;
+}
+
+/* in-place mode: names and values are terminated inside the parsed buffer.
+ * The byte following a word may still be needed by the parser (e.g. the
+ * whitespace or '>' ending a tag name), so the terminator is only written
+ * once parsing has moved on to the next word. */
+static void
+flushTerm(XmlDoc *doc)
+{
+    if (doc->term)
+    {
+	/* newlines are counted when needed, remember the ones lost */
+	if (*doc->term == '\n')
+	{
+	    ++doc->termLines;
+	    doc->termLine = doc->term + 1;
+	}
+	*doc->term = '\0';
+	doc->term = 0;
+    }
+}
+
+static char *
+inPlaceWord(XmlDoc *doc, const char *start, size_t n)
+{
+    /* a word reaching the end of the buffer can't be terminated there */
+    if (start + n == doc->end) return cloneString(doc, start, n);
+
+    flushTerm(doc);
+    doc->term = (char *)start + n;
+    return (char *)start;
+}
+
+static char *
+word(XmlDoc *doc, const char *start, size_t n)
+{
+    if (doc->inPlace) return inPlaceWord(doc, start, n);
+    return cloneString(doc, start, n);
+}
+
+static unsigned long
+hashName(const char *name, size_t len)
+{
+    unsigned long hash = 2166136261UL;
+
+    while (len--)
+    {
+	hash ^= (unsigned char)*name++;
+	hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+}
+
+static unsigned long
+hashPointer(const void *p)
+{
+    return ((unsigned long)(size_t)p >> 3) * 2654435761UL;
+}
+
+static struct nameEntry *
+findName(const XmlNameTable *t, const char *name, size_t len,
+	unsigned long hash)
+{
+    struct nameEntry *e;
+    size_t i;
+
+    for (i = hash & (t->size - 1); (e = t->entries + i)->name;
+	    i = (i + 1) & (t->size - 1))
+    {
+	if (e->hash == hash && e->len == len && !memcmp(e->name, name, len))
+	{
+	    break;
+	}
+    }
+    return e;
+}
+
+static int
+growNames(XmlNameTable *t)
+{
+    struct nameEntry *old = t->entries;
+    size_t oldSize = t->size;
+    size_t size = oldSize ? oldSize * 2 : 64;
+    struct nameEntry *entries = arenaAlloc(t->arena, size * sizeof *entries);
+    size_t i;
+
+    if (!entries) return -1;
+
+    /* the old entries stay in the arena */
+    memset(entries, 0, size * sizeof *entries);
+    t->entries = entries;
+    t->size = size;
+    for (i = 0; i < oldSize; ++i) if (old[i].name)
+    {
+	*findName(t, old[i].name, old[i].len, old[i].hash) = old[i];
+    }
+    return 0;
+}
+
+/* the entry of the stored copy of a name, with a document's own table this
+ * is the first occurrence (left in place when parsing in place). The entry
+ * is only valid until the next name is added. Returns 0 if memory ran
+ * out. */
+static const struct nameEntry *
+internEntry(XmlDoc *doc, const char *name, size_t len)
+{
+    XmlNameTable *t = doc->names;
+    unsigned long hash = hashName(name, len);
+    struct nameEntry *e;
+
+    if (t->count * 2 >= t->size && growNames(t) < 0) return 0;
+    e = findName(t, name, len, hash);
+    if (!e->name)
+    {
+	if (t == &doc->ownNames)
+	{
+	    e->name = doc->inPlace && name >= doc->text && name < doc->end ?
+		inPlaceWord(doc, name, len) : cloneString(doc, name, len);
+	}
+	else e->name = arenaString(t->arena, name, len);
+	if (!e->name) return 0;
+	e->len = len;
+	e->hash = hash;
+	++t->count;
+    }
+    return e;
+}
+
+static char *
+internName(XmlDoc *doc, const char *name, size_t len)
+{
+    const struct nameEntry *e = internEntry(doc, name, len);
+
+    return e ? (char *)e->name : 0;
+}
+
+/* whitespace as in the "C" locale, independent of the current locale */
+#define isWs(c) ((c) == ' ' || (unsigned char)((c) - 9) < 5)
+
+/* scanning whitespace, text and quoted values takes most of the parse time,
+ * so there are SSE2 and AVX2 versions of these loops, picked at startup
+ * depending on the CPU. Newlines are only counted when a position is needed
+ * as line and column, for an error or by xmlNodeLine(). */
+static const char *
+skipWsScalar(XmlDoc *doc, const char *pos)
+{
+    while (pos != doc->end && isWs(*pos)) ++pos;
+    return pos;
+}
+
+static const char *
+skipUntilScalar(XmlDoc *doc, const char *pos, char endmark)
+{
+    while (pos != doc->end && *pos != endmark) ++pos;
+    return pos;
+}
+
+/* newlines between start and end, *lineStart is set after the last one and
+ * left alone if there is none */
+static long
+countLinesScalar(const char *start, const char *end, const char **lineStart)
+{
+    long lines = 0;
+
+    for (; start != end; ++start) if (*start == '\n')
+    {
+	++lines;
+	*lineStart = start + 1;
+    }
+    return lines;
+}
+
+static int
+hasNonWsScalar(const char *start, const char *end)
+{
+    for (; start != end; ++start) if (!isWs(*start)) return 1;
+    return 0;
+}
+
+#ifdef BADXML_X86SIMD
+#define SCANNERS(isa, tgt, vec, width, load, set1, cmpeq, cmpgt, \
+	and, or, movemask) \
+__attribute__((target(tgt))) static const char * \
+skipWs##isa(XmlDoc *doc, const char *pos) \
+{ \
+    const vec sp = set1(' '); \
+    const vec lo = set1(8); \
+    const vec hi = set1(14); \
+    vec v; \
+    unsigned int stop; \
+\
+    while (doc->end - pos >= width) \
+    { \
+	v = load((const vec *)pos); \
+	stop = ~(unsigned int)movemask(or(cmpeq(v, sp), \
+		    and(cmpgt(v, lo), cmpgt(hi, v)))); \
+	if (width < 32) stop &= (1U << (width & 31)) - 1; \
+	if (stop) return pos + __builtin_ctz(stop); \
+	pos += width; \
+    } \
+    return skipWsScalar(doc, pos); \
+} \
+\
+__attribute__((target(tgt))) static const char * \
+skipUntil##isa(XmlDoc *doc, const char *pos, char endmark) \
+{ \
+    const vec em = set1(endmark); \
+    unsigned int stop; \
+\
+    while (doc->end - pos >= width) \
+    { \
+	stop = (unsigned int)movemask(cmpeq(load((const vec *)pos), em)); \
+	if (stop) return pos + __builtin_ctz(stop); \
+	pos += width; \
+    } \
+    return skipUntilScalar(doc, pos, endmark); \
+} \
+\
+__attribute__((target(tgt))) static long \
+countLines##isa(const char *start, const char *end, const char **lineStart) \
+{ \
+    const vec lf = set1('\n'); \
+    unsigned int nl; \
+    long lines = 0; \
+\
+    while (end - start >= width) \
+    { \
+	nl = (unsigned int)movemask(cmpeq(load((const vec *)start), lf)); \
+	if (nl) \
+	{ \
+	    lines += __builtin_popcount(nl); \
+	    *lineStart = start + (32 - __builtin_clz(nl)); \
+	} \
+	start += width; \
+    } \
+    return lines + countLinesScalar(start, end, lineStart); \
+} \
+\
+__attribute__((target(tgt))) static int \
+hasNonWs##isa(const char *start, const char *end) \
+{ \
+    const vec sp = set1(' '); \
+    const vec lo = set1(8); \
+    const vec hi = set1(14); \
+    vec v; \
+    unsigned int ws; \
+\
+    while (end - start >= width) \
+    { \
+	v = load((const vec *)start); \
+	ws = (unsigned int)movemask(or(cmpeq(v, sp), \
+		    and(cmpgt(v, lo), cmpgt(hi, v)))); \
+	if (width < 32) ws |= ~((1U << (width & 31)) - 1); \
+	if (~ws) return 1; \
+	start += width; \
+    } \
+    return hasNonWsScalar(start, end); \
+}
+
+SCANNERS(Sse2, "sse2", __m128i, 16, _mm_loadu_si128, _mm_set1_epi8,
+	_mm_cmpeq_epi8, _mm_cmpgt_epi8, _mm_and_si128, _mm_or_si128,
+	_mm_movemask_epi8)
+SCANNERS(Avx2, "avx2,popcnt", __m256i, 32, _mm256_loadu_si256,
+	_mm256_set1_epi8, _mm256_cmpeq_epi8, _mm256_cmpgt_epi8, _mm256_and_si256,
+	_mm256_or_si256, _mm256_movemask_epi8)
+#endif
+
+static struct
+{
+    const char *(*skipWs)(XmlDoc *doc, const char *pos);
+    const char *(*skipUntil)(XmlDoc *doc, const char *pos, char endmark);
+    int (*hasNonWs)(const char *start, const char *end);
+    long (*countLines)(const char *start, const char *end,
+	    const char **lineStart);
+} scanners = {
+    skipWsScalar, skipUntilScalar, hasNonWsScalar, countLinesScalar
+};
+
+#ifdef BADXML_X86SIMD
+__attribute__((constructor)) static void
+selectScanners(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")
+	    && __builtin_cpu_supports("popcnt"))
+    {
+	scanners.skipWs = skipWsAvx2;
+	scanners.skipUntil = skipUntilAvx2;
+	scanners.hasNonWs = hasNonWsAvx2;
+	scanners.countLines = countLinesAvx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+	scanners.skipWs = skipWsSse2;
+	scanners.skipUntil = skipUntilSse2;
+	scanners.hasNonWs = hasNonWsSse2;
+	scanners.countLines = countLinesSse2;
+    }
+}
+#endif
+
+static void
+skipWs(XmlDoc *doc, const char **pos)
+{
+    /* most runs of whitespace are empty or a single blank */
+    if (*pos == doc->end || !isWs(**pos)) return;
+    if (**pos == ' ' && (++(*pos) == doc->end || !isWs(**pos))) return;
+    *pos = scanners.skipWs(doc, *pos);
+}
+
+static void
+skipUntil(XmlDoc *doc, const char **pos, char endmark)
+{
+    *pos = scanners.skipUntil(doc, *pos, endmark);
+}
+
+static int
+hasNonWs(const char *start, const char *end)
+{
+    return scanners.hasNonWs(start, end);
+}
+
+/* line and column of pos, counting the newlines before it. The text starts
+ * in line textLine, with lineCarry characters of that line in earlier chunks
+ * when parsing chunked input. Parsing in place only overwrites newlines
+ * before the position of an error, they are added from termLines. */
+static void
+position(const XmlDoc *doc, const char *pos, long *line, long *col)
+{
+    const char *lineStart = 0;
+
+    *line = doc->textLine + doc->termLines
+	+ scanners.countLines(doc->text, pos, &lineStart);
+    if (doc->termLine && (!lineStart || doc->termLine > lineStart))
+    {
+	lineStart = doc->termLine;
+    }
+    *col = lineStart ? pos - lineStart + 1
+	: pos - doc->text + 1 + doc->lineCarry;
+}
+
+static void
+appendString(XmlDoc *doc, char **s, struct valueBuilder *vb,
+	const char *src, size_t n)
+{
+    char *joined;
+    size_t size;
+
+    if (!*s)
+    {
+	if (!(*s = word(doc, src, n)))
+	{
+	    noMem(doc);
+	    return;
+	}
+	vb->len = n;
+
+	/* a value still in the in-place buffer isn't ours to grow */
+	vb->size = doc->inPlace && *s >= doc->text && *s < doc->end ? 0 : n + 1;
+	return;
+    }
+
+    if (vb->len + n + 1 > vb->size)
+    {
+	/* grow geometrically, so content interleaved with many child
+	 * elements is still copied only a constant number of times */
+	size = vb->size * 2;
+	if (size < vb->len + n + 1) size = vb->len + n + 1;
+	if (vb->size)
+	{
+	    joined = arenaGrow(&doc->arena, *s, vb->len + 1, size);
+	}
+	else if ((joined = arenaAlloc(&doc->arena, size)))
+	{
+	    memcpy(joined, *s, vb->len);
+	}
+	if (!joined)
+	{
+	    noMem(doc);
+	    return;
+	}
+	*s = joined;
+	vb->size = size;
+    }
+    memcpy(*s + vb->len, src, n);
+    vb->len += n;
+    (*s)[vb->len] = '\0';
+}
+
+#define FAIL(x) \
+    do { doc->err = (x); goto fail; } while(0)
+#define FAILS(x, es) \
+    do { doc->err = (x); doc->errInfo.s = (es); goto fail; } while (0)
+#define FAILC(x, ec) \
+    do { doc->err = (x); doc->errInfo.c = (ec); goto fail; } while (0)
+
+static void
+skipWord(XmlDoc *doc, const char **pos, const char *endmarks)
+{
+    while (*pos != doc->end && !isWs(**pos))
+    {
+	const char *testend = endmarks;
+	while (*testend) if (**pos == *testend++) return;
+	++(*pos);
+    }
+}
+
+static double
+statsClock(void)
+{
+#ifdef WIN32
+    LARGE_INTEGER now;
+    LARGE_INTEGER freq;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+/* complete the memory figures in the caller's statistics of doc */
+static void
+updateStats(const XmlDoc *doc)
+{
+    const struct arenaChunk *chunk;
+    const struct nodeBlock *b;
+    XmlStats *out = doc->stats->out;
+    size_t bytes = 0;
+    size_t grown = 0;
+    size_t live = 0;
+
+    out->allocations = doc->stats->tempAllocs;
+    for (chunk = doc->arena.chunks; chunk; chunk = chunk->next)
+    {
+	++out->allocations;
+	bytes += offsetof(struct arenaChunk, data) + chunk->size;
+    }
+    for (chunk = doc->rows.chunks; chunk; chunk = chunk->next)
+    {
+	++out->allocations;
+	bytes += offsetof(struct arenaChunk, data) + chunk->size;
+    }
+    for (b = doc->blocks; b; b = b->next)
+    {
+	out->allocations += b->allocs;
+	grown += b->allocated;
+	if (b->elements && !b->image)
+	{
+	    live += BLOCK_HEAD + b->size * sizeof *b->elements;
+	}
+	if (b->spans) live += b->size * sizeof *b->spans;
+	live += b->attsSize * sizeof *b->attSpans;
+    }
+
+    /* the arenas only grow until the document is freed, arrays of blocks
+     * also count with the sizes they had while growing */
+    out->allocated = bytes + grown + doc->stats->tempBytes;
+    out->peakLive = bytes + live + doc->stats->tempPeak;
+}
+
+void
+xmlSetAllocator(const XmlAllocator *allocator)
+{
+    globalAllocator = allocator ? *allocator : stdAllocator;
+}
+
+/* nodes of a loaded binary image */
+static void
+releaseImage(XmlDoc *doc)
+{
+    if (!doc->image) return;
+#ifdef WIN32
+    releaseMem(docAllocator(doc), doc->image, doc->imageSize);
+#else
+    munmap(doc->image, doc->imageSize);
+#endif
+    doc->image = 0;
+}
+
+void
+freeDoc(XmlDoc *doc)
+{
+    struct nodeBlock *b;
+    XmlStats *stats = 0;
+    double start = 0;
+
+    if (!doc) return;
+    if (doc->stats)
+    {
+	updateStats(doc);
+	if (doc->stats->timing)
+	{
+	    stats = doc->stats->out;
+	    start = statsClock();
+	}
+    }
+
+    releaseImage(doc);
+    for (b = doc->blocks; b; b = b->next) releaseBlock(doc, b);
+    releaseBlock(doc, &doc->spare);
+
+    /* the document itself lives in its first arena chunk */
+    arenaFree(&doc->rows);
+    arenaFree(&doc->arena);
+    if (stats) stats->freeTime = statsClock() - start;
+}
+
+/* the tokenizer is an explicit state machine, so nesting depth is only
+ * limited by memory. Names of open elements are kept on a stack for
+ * matching closing tags.
+ *
+ * Input may come in chunks: at the end of a chunk that isn't final, the
+ * tokenizer suspends in its current state, saving the part of an unfinished
+ * token (and a pending attribute name), and continues with the next chunk
+ * where it left off. */
+enum tokState
+{
+    TS_TOP,		/* outside of the root element */
+    TS_TOPLT,		/* after '<' outside of the root element */
+    TS_DECL,		/* <! or <? outside of the root element */
+    TS_STRAY,		/* name of a closing tag without opening tag */
+    TS_TAGNAME,		/* name of an opening tag */
+    TS_TAG,		/* inside an opening tag, between attributes */
+    TS_EMPTY,		/* after '/' in an opening tag */
+    TS_ATTNAME,		/* attribute name */
+    TS_ATTEQ,		/* after attribute name, before '=' */
+    TS_ATTVAL,		/* after '=', before the value */
+    TS_QVAL,		/* quoted attribute value */
+    TS_BVAL,		/* bareword attribute value */
+    TS_CONTENT,		/* text content of an element */
+    TS_CONTENTLT,	/* after '<' inside an element */
+    TS_CLOSE,		/* after "</" inside an element */
+    TS_CLOSENAME,	/* name of a closing tag */
+    TS_CLOSEEND		/* after the name of a closing tag */
+};
+
+#define TOK_NAMEBUF 256
+#define TOK_LEVELBUF 32
+
+struct tokenizer
+{
+    XmlDoc *doc;
+    const XmlHandler *handler;
+    void *ctx;
+    enum tokState state;
+    const char *tokStart;
+    const char *attName;
+    size_t attNameLen;
+
+    /* position of an error found later, kept as line and column once its
+     * chunk is gone */
+    const char *mark;
+    long markLine;
+    long markCol;
+    size_t matched;
+    char quote;
+    int hasRoot;
+    int final;
+    char *tok;
+    size_t tokLen;
+    size_t tokSize;
+    char *att;
+    size_t attSize;
+    char *names;
+    size_t namesLen;
+    size_t namesSize;
+    size_t *levels;
+    size_t depth;
+    size_t levelsSize;
+    size_t lazyDepth;
+    int skip;
+    size_t allocs;
+    size_t allocated;
+    char nameBuf[TOK_NAMEBUF];
+    size_t levelBuf[TOK_LEVELBUF];
+};
+
+static void
+initTokenizer(struct tokenizer *t, XmlDoc *doc,
+	const XmlHandler *handler, void *ctx)
+{
+    t->doc = doc;
+    t->handler = handler;
+    t->ctx = ctx;
+    t->state = TS_TOP;
+    t->mark = 0;
+    t->hasRoot = 0;
+    t->final = 1;
+    t->tok = 0;
+    t->tokLen = 0;
+    t->tokSize = 0;
+    t->att = 0;
+    t->attSize = 0;
+    t->names = t->nameBuf;
+    t->namesLen = 0;
+    t->namesSize = TOK_NAMEBUF;
+    t->levels = t->levelBuf;
+    t->depth = 0;
+    t->levelsSize = TOK_LEVELBUF;
+    t->lazyDepth = 0;
+    t->skip = 0;
+    t->allocs = 0;
+    t->allocated = 0;
+}
+
+static void
+doneTokenizer(struct tokenizer *t)
+{
+    const XmlAllocator *allocator = docAllocator(t->doc);
+    struct docStats *stats = t->doc->stats;
+    size_t live = t->tokSize + t->attSize;
+
+    if (stats)
+    {
+	if (t->names != t->nameBuf) live += t->namesSize;
+	if (t->levels != t->levelBuf) live += t->levelsSize * sizeof *t->levels;
+	stats->tempAllocs += t->allocs;
+	stats->tempBytes += t->allocated;
+	if (live > stats->tempPeak) stats->tempPeak = live;
+    }
+    if (t->names != t->nameBuf) releaseMem(allocator, t->names, t->namesSize);
+    if (t->levels != t->levelBuf)
+    {
+	releaseMem(allocator, t->levels, t->levelsSize * sizeof *t->levels);
+    }
+    releaseMem(allocator, t->tok, t->tokSize);
+    releaseMem(allocator, t->att, t->attSize);
+}
+
+/* append the current token up to pos to the saved part */
+static void
+saveToken(struct tokenizer *t, const char *pos)
+{
+    size_t len = (size_t)(pos - t->tokStart);
+    size_t size = t->tokSize ? t->tokSize : 64;
+    char *tok;
+
+    if (!len) return;
+    if (t->tokSize - t->tokLen < len)
+    {
+	while (size - t->tokLen < len) size *= 2;
+	tok = resizeMem(docAllocator(t->doc), t->tok, t->tokSize, size);
+	if (!tok)
+	{
+	    noMem(t->doc);
+	    return;
+	}
+	t->tok = tok;
+	t->tokSize = size;
+	++t->allocs;
+	t->allocated += t->tokSize;
+    }
+    memcpy(t->tok + t->tokLen, t->tokStart, len);
+    t->tokLen += len;
+    t->tokStart = pos;
+}
+
+/* the current token ends at pos, get it as one piece */
+static const char *
+endToken(struct tokenizer *t, const char *pos, size_t *len)
+{
+    if (!t->tokLen)
+    {
+	*len = (size_t)(pos - t->tokStart);
+	return t->tokStart;
+    }
+    saveToken(t, pos);
+    *len = t->tokLen;
+    t->tokLen = 0;
+    return t->tok;
+}
+
+/* keep the pending attribute name when its chunk (or the token buffer
+ * holding it) is about to be reused */
+static void
+saveAttName(struct tokenizer *t)
+{
+    char *att;
+
+    if (t->attName == t->att) return;
+    if (t->attSize < t->attNameLen)
+    {
+	att = resizeMem(docAllocator(t->doc), t->att, t->attSize,
+		t->attNameLen);
+	if (!att)
+	{
+	    noMem(t->doc);
+	    return;
+	}
+	t->att = att;
+	t->attSize = t->attNameLen;
+	++t->allocs;
+	t->allocated += t->attSize;
+    }
+    memcpy(t->att, t->attName, t->attNameLen);
+    t->attName = t->att;
+}
+
+static void
+pushName(struct tokenizer *t, const char *name, size_t len)
+{
+    const XmlAllocator *allocator = docAllocator(t->doc);
+    char *names;
+    size_t *levels;
+    size_t oldSize;
+
+    if (t->depth == t->levelsSize)
+    {
+	levels = allocMem(allocator, 2 * t->levelsSize * sizeof *levels);
+	if (!levels)
+	{
+	    noMem(t->doc);
+	    return;
+	}
+	memcpy(levels, t->levels, t->depth * sizeof *levels);
+	if (t->levels != t->levelBuf)
+	{
+	    releaseMem(allocator, t->levels, t->levelsSize * sizeof *levels);
+	}
+	t->levels = levels;
+	t->levelsSize *= 2;
+	++t->allocs;
+	t->allocated += t->levelsSize * sizeof *levels;
+    }
+    if (t->namesSize - t->namesLen < len)
+    {
+	oldSize = t->namesSize;
+	while (t->namesSize - t->namesLen < len) t->namesSize *= 2;
+	if (!(names = allocMem(allocator, t->namesSize)))
+	{
+	    t->namesSize = oldSize;
+	    noMem(t->doc);
+	    return;
+	}
+	memcpy(names, t->names, t->namesLen);
+	if (t->names != t->nameBuf) releaseMem(allocator, t->names, oldSize);
+	t->names = names;
+	++t->allocs;
+	t->allocated += t->namesSize;
+    }
+    t->levels[t->depth++] = t->namesLen;
+    memcpy(t->names + t->namesLen, name, len);
+    t->namesLen += len;
+}
+
+static void
+closeElement(struct tokenizer *t, const char *pos)
+{
+    size_t start = t->levels[t->depth - 1];
+
+    t->doc->tagEnd = pos;
+    if (t->handler->endElement)
+    {
+	t->handler->endElement(t->ctx, t->names + start, t->namesLen - start);
+    }
+    t->namesLen = start;
+    t->state = --t->depth ? TS_CONTENT : TS_TOP;
+    t->tokStart = pos;
+}
+
+/* skip the attributes of an opening tag and its end, following the same
+ * syntax as the tokenizer. Returns the position after the tag or 0 if it's
+ * malformed, depth is incremented unless the tag is empty. */
+static const char *
+skipAttributes(XmlDoc *doc, const char *pos, size_t *depth)
+{
+    const char *start;
+    char quote;
+
+    while (1)
+    {
+	skipWs(doc, &pos);
+	if (pos == doc->end) return 0;
+	if (*pos == '>')
+	{
+	    ++*depth;
+	    return pos + 1;
+	}
+	if (*pos == '/')
+	{
+	    ++pos;
+	    skipWs(doc, &pos);
+	    return pos != doc->end && *pos == '>' ? pos + 1 : 0;
+	}
+	start = pos;
+	skipWord(doc, &pos, "=");
+	if (pos == start) return 0;
+	skipWs(doc, &pos);
+	if (pos == doc->end || *pos != '=') return 0;
+	++pos;
+	skipWs(doc, &pos);
+	if (pos == doc->end) return 0;
+	if (*pos == '"' || *pos == '\'')
+	{
+	    quote = *pos++;
+	    skipUntil(doc, &pos, quote);
+	    if (pos == doc->end) return 0;
+	    ++pos;
+	}
+	else skipWord(doc, &pos, "/>");
+    }
+}
+
+/* skip an opening tag from its name */
+static const char *
+skipTag(XmlDoc *doc, const char *pos, size_t *depth)
+{
+    const char *start = pos;
+
+    skipWord(doc, &pos, ">");
+    if (pos == start) return 0;
+    return skipAttributes(doc, pos, depth);
+}
+
+/* skip the content of an element and its closing tag without building it.
+ * Only levels are counted, names of closing tags are checked once the
+ * content is built. Returns 0 if the closing tag isn't found, so the
+ * tokenizer can report the exact error. */
+static const char *
+skipContent(XmlDoc *doc, const char *pos)
+{
+    size_t depth = 1;
+
+    while (pos)
+    {
+	skipUntil(doc, &pos, '<');
+	if (pos == doc->end || ++pos == doc->end) break;
+	if (*pos == '/')
+	{
+	    skipUntil(doc, &pos, '>');
+	    if (pos == doc->end) break;
+	    ++pos;
+	    if (!--depth) return pos;
+	}
+	else pos = skipTag(doc, pos, &depth);
+    }
+    return 0;
+}
+
+/* skip the rest of an element after the name of its opening tag, for
+ * elements not built by projection parsing */
+static const char *
+skipElement(XmlDoc *doc, const char *pos)
+{
+    size_t depth = 0;
+
+    if ((pos = skipAttributes(doc, pos, &depth)) && depth)
+    {
+	pos = skipContent(doc, pos);
+    }
+    return pos;
+}
+
+/* the current element's content is built later by materialize() */
+static void
+deferContent(XmlDoc *doc, const char *start, const char *end)
+{
+    XmlElement *e = doc->build->elements + doc->current - 1;
+    struct lazyContent *lc = arenaAlloc(&doc->arena, sizeof *lc);
+
+    if (!lc)
+    {
+	noMem(doc);
+	return;
+    }
+    lc->doc = doc;
+    lc->start = start;
+    lc->end = end;
+    lc->value = 0;
+    lc->children = 0;
+    e->value = (char *)lc;
+    e->lazy = 1;
+}
+
+#define WANTMORE() \
+    do { if (!t->final) goto suspend; FAIL(XML_EOF); } while (0)
+
+/* memory ran out in the tokenizer or a callback */
+#define CHECKMEM() do { if (doc->err != XML_SUCCESS) return; } while (0)
+
+static void
+tokenize(struct tokenizer *t, const char *pos)
+{
+    XmlDoc *doc = t->doc;
+    const XmlHandler *h = t->handler;
+    const char *endval;
+    const char *name;
+    size_t len;
+
+    CHECKMEM();
+    t->tokStart = pos;
+
+    while (1) switch (t->state)
+    {
+	case TS_TOP:
+	    skipWs(doc, &pos);
+	    if (pos == doc->end) return;
+	    if (*pos != '<') FAILC(XML_UNEXPECTED, *pos);
+	    t->mark = pos++;
+	    t->state = TS_TOPLT;
+	    break;
+
+	case TS_TOPLT:
+	    if (pos == doc->end && !t->final) goto suspend;
+	    if (pos != doc->end && (*pos == '!' || *pos == '?'))
+	    {
+		t->state = TS_DECL;
+		break;
+	    }
+	    if (t->hasRoot)
+	    {
+		doc->err = XML_SECONDROOT;
+		goto failmark;
+	    }
+	    if (pos == doc->end) FAIL(XML_EOF);
+	    if (*pos == '/')
+	    {
+		t->tokStart = ++pos;
+		t->state = TS_STRAY;
+		break;
+	    }
+	    t->hasRoot = 1;
+	    t->tokStart = pos;
+	    t->state = TS_TAGNAME;
+	    break;
+
+	case TS_DECL:
+	    skipUntil(doc, &pos, '>');
+	    if (pos == doc->end) WANTMORE();
+	    ++pos;
+	    t->state = TS_TOP;
+	    break;
+
+	case TS_STRAY:
+	    skipWord(doc, &pos, ">");
+	    if (pos == doc->end && !t->final) goto suspend;
+	    name = endToken(t, pos, &len);
+	    CHECKMEM();
+	    FAILS(XML_CLOSEWOOPEN, len ? cloneString(doc, name, len) : 0);
+
+	case TS_TAGNAME:
+	    skipWord(doc, &pos, ">");
+	    if (pos == doc->end) WANTMORE();
+	    name = endToken(t, pos, &len);
+	    CHECKMEM();
+	    if (!len) FAIL(XML_UNNAMEDTAG);
+	    pushName(t, name, len);
+	    CHECKMEM();
+	    if (h->startElement) h->startElement(t->ctx, name, len);
+	    CHECKMEM();
+	    t->state = TS_TAG;
+	    break;
+
+	case TS_TAG:
+	    if (t->skip)
+	    {
+		t->skip = 0;
+		if ((endval = skipElement(doc, pos)))
+		{
+		    closeElement(t, pos = endval);
+		    break;
+		}
+	    }
+	    skipWs(doc, &pos);
+	    if (pos == doc->end) WANTMORE();
+	    if (*pos == '>')
+	    {
+		t->tokStart = ++pos;
+		t->state = TS_CONTENT;
+		if (t->depth == t->lazyDepth
+			&& (endval = skipContent(doc, pos)))
+		{
+		    deferContent(doc, pos, endval);
+		    CHECKMEM();
+		    closeElement(t, pos = endval);
+		}
+	    }
+	    else if (*pos == '/')
+	    {
+		++pos;
+		t->state = TS_EMPTY;
+	    }
+	    else
+	    {
+		t->tokStart = pos;
+		t->state = TS_ATTNAME;
+	    }
+	    break;
+
+	case TS_EMPTY:
+	    skipWs(doc, &pos);
+	    if (pos == doc->end) WANTMORE();
+	    if (*pos != '>') FAILC(XML_UNEXPECTED, *pos);
+	    closeElement(t, ++pos);
+	    break;
+
+	case TS_ATTNAME:
+	    skipWord(doc, &pos, "=");
+	    if (pos == doc->end) WANTMORE();
+	    t->attName = endToken(t, pos, &t->attNameLen);
+	    CHECKMEM();
+	    if (!t->attNameLen) FAIL(XML_UNNAMEDATTR);
+	    if (t->attName == t->tok) saveAttName(t);
+	    CHECKMEM();
+	    t->state = TS_ATTEQ;
+	    break;
+
+	case TS_ATTEQ:
+	    skipWs(doc, &pos);
+	    if (pos == doc->end) WANTMORE();
+	    if (*pos != '=') FAILC(XML_UNEXPECTED, *pos);
+	    ++pos;
+	    t->state = TS_ATTVAL;
+	    break;
+
+	case TS_ATTVAL:
+	    skipWs(doc, &pos);
+	    if (pos == doc->end) WANTMORE();
+	    if (*pos == '"' || *pos == '\'')
+	    {
+		t->quote = *pos++;
+		t->state = TS_QVAL;
+	    }
+	    else t->state = TS_BVAL;
+	    t->tokStart = pos;
+	    break;
+
+	case TS_QVAL:
+	case TS_BVAL:
+	    if (t->state == TS_QVAL) skipUntil(doc, &pos, t->quote);
+	    else skipWord(doc, &pos, "/>");
+	    if (pos == doc->end) WANTMORE();
+	    name = endToken(t, pos, &len);
+	    CHECKMEM();
+	    if (h->attribute)
+	    {
+		h->attribute(t->ctx, t->attName, t->attNameLen, name, len);
+	    }
+	    CHECKMEM();
+	    if (t->state == TS_QVAL) ++pos;
+	    t->state = TS_TAG;
+	    break;
+
+	case TS_CONTENT:
+	    skipUntil(doc, &pos, '<');
+	    if (pos == doc->end) WANTMORE();
+	    name = endToken(t, pos, &len);
+	    CHECKMEM();
+	    if (h->text && hasNonWs(name, name + len))
+	    {
+		endval = name + len;
+		while (isWs(*(endval-1))) --endval;
+		h->text(t->ctx, name, (size_t)(endval - name));
+		CHECKMEM();
+	    }
+	    ++pos;
+	    t->state = TS_CONTENTLT;
+	    break;
+
+	case TS_CONTENTLT:
+	    if (pos == doc->end) WANTMORE();
+	    if (*pos == '/')
+	    {
+		++pos;
+		t->state = TS_CLOSE;
+	    }
+	    else
+	    {
+		t->tokStart = pos;
+		t->state = TS_TAGNAME;
+	    }
+	    break;
+
+	case TS_CLOSE:
+	    skipWs(doc, &pos);
+	    if (pos == doc->end) WANTMORE();
+	    t->mark = pos;
+	    t->matched = 0;
+	    t->state = TS_CLOSENAME;
+	    break;
+
+	case TS_CLOSENAME:
+	    name = t->names + t->levels[t->depth - 1];
+	    len = t->namesLen - t->levels[t->depth - 1];
+	    while (t->matched < len)
+	    {
+		if (pos == doc->end && !t->final) goto suspend;
+		if (pos == doc->end || *pos != name[t->matched])
+		{
+		    doc->err = XML_UNMATCHEDCLOSE;
+		    doc->errInfo.s = cloneString(doc, name, len);
+		    goto failmark;
+		}
+		++pos;
+		++t->matched;
+	    }
+	    t->state = TS_CLOSEEND;
+	    break;
+
+	case TS_CLOSEEND:
+	    skipWs(doc, &pos);
+	    if (pos == doc->end) WANTMORE();
+	    if (*pos != '>') FAILC(XML_UNEXPECTED, *pos);
+	    closeElement(t, ++pos);
+	    break;
+    }
+
+suspend:
+    switch (t->state)
+    {
+	case TS_ATTEQ:
+	case TS_ATTVAL:
+	    saveAttName(t);
+	    break;
+
+	case TS_QVAL:
+	case TS_BVAL:
+	    saveAttName(t);
+	    saveToken(t, pos);
+	    break;
+
+	case TS_STRAY:
+	case TS_TAGNAME:
+	case TS_ATTNAME:
+	case TS_CONTENT:
+	    saveToken(t, pos);
+	    break;
+
+	default:
+	    break;
+    }
+    return;
+
+fail:
+    position(doc, pos, &doc->line, &doc->col);
+    return;
+
+failmark:
+    if (t->mark) position(doc, t->mark, &doc->line, &doc->col);
+    else
+    {
+	doc->line = t->markLine;
+	doc->col = t->markCol;
+    }
+}
+
+static struct attTable *
+newAttTable(XmlDoc *doc, size_t size)
+{
+    struct attTable *t = arenaAlloc(&doc->arena,
+	    offsetof(struct attTable, slots) + size * sizeof *t->slots);
+
+    if (!t) return 0;
+    t->size = size;
+    t->count = 0;
+    t->dups = 0;
+    memset(t->slots, 0, size * sizeof *t->slots);
+    return t;
+}
+
+static void
+attTableInsert(struct attTable *t, const XmlAttribute *row, size_t i,
+	unsigned long hash)
+{
+    size_t j;
+
+    /* names are interned, so equal names are the same pointer */
+    for (j = hash & (t->size - 1);
+	    t->slots[j]; j = (j + 1) & (t->size - 1))
+    {
+	if (row[t->slots[j] - 1].name == row[i].name)
+	{
+	    t->dups = 1;
+	    return;
+	}
+    }
+    t->slots[j] = i + 1;
+    ++t->count;
+}
+
+/* find an attribute of e by name, e must have a table */
+static XmlAttribute *
+attTableFind(const XmlElement *e, const char *name, size_t len)
+{
+    const struct attTable *t = attTableOf(e);
+    XmlAttribute *a;
+    size_t i;
+
+    for (i = hashName(name, len) & (t->size - 1);
+	    t->slots[i]; i = (i + 1) & (t->size - 1))
+    {
+	a = e->attributes + t->slots[i] - 1;
+	if (!strncmp(a->name, name, len) && !a->name[len]) return a;
+    }
+    return 0;
+}
+
+/* build the attribute table of e from its attributes, hashes has the
+ * hashes of their names or is 0 to compute them. If memory runs out, e is
+ * left without a table (its attributes are searched in order then) and -1
+ * is returned. */
+static int
+tableAttributes(XmlDoc *doc, XmlElement *e, const unsigned long *hashes)
+{
+    const XmlAttribute *row = e->attributes;
+    struct attTable *t;
+    size_t size = 4;
+    size_t i;
+
+    while (3 * size < 4 * (size_t)e->natts + 4) size *= 2;
+    t = newAttTable(doc, size);
+    ((struct attTable **)(void *)e->attributes)[-1] = t;
+    if (!t) return -1;
+    for (i = 0; i < e->natts; ++i)
+    {
+	attTableInsert(t, row, i, hashes ? hashes[i]
+		: hashName(row[i].name, strlen(row[i].name)));
+    }
+    return 0;
+}
+
+/* add the new attribute i of e to its table, growing it as needed. The old
+ * table is left in the arena. */
+static int
+addAttribute(XmlDoc *doc, XmlElement *e, size_t i, unsigned long hash)
+{
+    struct attTable *t = attTableOf(e);
+
+    if (4 * (t->count + 1) > 3 * t->size)
+    {
+	return tableAttributes(doc, e, 0);
+    }
+    attTableInsert(t, e->attributes, i, hash);
+    return 0;
+}
+
+/* room for another attribute in the row of e, or 0 if memory ran out. The
+ * row grows in place as long as nothing else is allocated from doc->rows,
+ * the slot for its table is put in front of it when it gets ATTTABLE_MIN
+ * attributes. */
+static XmlAttribute *
+addToRow(XmlDoc *doc, XmlElement *e)
+{
+    size_t n = e->natts;
+    size_t head = n >= ATTTABLE_MIN ? ATTTABLE_HEAD : 0;
+    char *row;
+
+    if (n + 1 == ATTTABLE_MIN)
+    {
+	row = arenaAlloc(&doc->rows,
+		ATTTABLE_HEAD + ATTTABLE_MIN * sizeof *e->attributes);
+	if (!row) return 0;
+	*(struct attTable **)(void *)row = 0;
+	row += ATTTABLE_HEAD;
+	memcpy(row, e->attributes, n * sizeof *e->attributes);
+    }
+    else
+    {
+	row = arenaGrow(&doc->rows, n ? (char *)e->attributes - head : 0,
+		head + n * sizeof *e->attributes,
+		head + (n + 1) * sizeof *e->attributes);
+	if (!row) return 0;
+	row += head;
+    }
+    e->attributes = (XmlAttribute *)(void *)row;
+    ++e->natts;
+    return e->attributes + n;
+}
+
+/* append an element to the block being built, as the last child of the
+ * current element, and make it the current element. Returns 0 if memory
+ * ran out. */
+static XmlElement *
+newElement(XmlDoc *doc, const char *name)
+{
+    struct nodeBlock *b = doc->build;
+    XmlElement *element, *parent, *prev;
+
+    if (!b && !(b = doc->build = newBlock(doc))) return 0;
+    if (b->count == b->size
+	    && resizeBlock(doc, b, b->size ? b->size * 2 : BLOCK_FIRST) < 0)
+    {
+	return 0;
+    }
+    element = b->elements + b->count;
+    element->value = 0;
+    element->attributes = 0;
+    element->next = 0;
+    element->last = 0;
+    element->index = (unsigned int)b->count;
+    element->natts = 0;
+    element->lazy = 0;
+    element->stub = 0;
+    element->external = 0;
+    if (doc->current)
+    {
+	parent = b->elements + doc->current - 1;
+	element->parent = (unsigned int)(element - parent);
+	element->depth = (parent->depth + 1) & NODE_MAXDEPTH;
+	if (parent->last)
+	{
+	    prev = parent + parent->last;
+	    prev->next = (unsigned int)(element - prev);
+	}
+	parent->last = (unsigned int)(element - parent);
+    }
+    else
+    {
+	element->parent = 0;
+	element->depth = 0;
+    }
+    if (b->spans)
+    {
+	b->spans[b->count].start = name ? name - 1 : 0;
+	b->spans[b->count].end = 0;
+	b->spans[b->count].firstAtt = b->natts;
+    }
+    doc->current = ++b->count;
+    return element;
+}
+
+/* tokenizer callbacks building the document tree. If memory runs out,
+ * they fail the parse, leaving the tree built so far intact. */
+static void
+buildStart(void *ctx, const char *name, size_t nameLen)
+{
+    XmlDoc *doc = ctx;
+    char *interned = internName(doc, name, nameLen);
+    struct valueBuilder *values;
+    XmlElement *element;
+    size_t depth = doc->current
+	? (size_t)doc->build->elements[doc->current - 1].depth + 1 : 0;
+    size_t valuesSize;
+
+    if (!interned)
+    {
+	noMem(doc);
+	return;
+    }
+    if (depth >= doc->valuesSize)
+    {
+	/* one content builder per nesting level, the old array is left in
+	 * the arena */
+	valuesSize = doc->valuesSize ? doc->valuesSize * 2 : 16;
+	values = arenaGrow(&doc->arena, doc->values,
+		doc->valuesSize * sizeof *doc->values,
+		valuesSize * sizeof *doc->values);
+	if (!values)
+	{
+	    noMem(doc);
+	    return;
+	}
+	doc->values = values;
+	doc->valuesSize = valuesSize;
+    }
+    if (!(element = newElement(doc, name)))
+    {
+	noMem(doc);
+	return;
+    }
+    element->name = interned;
+    if (doc->stats)
+    {
+	++doc->stats->out->elements;
+	if (depth >= doc->stats->out->maxDepth)
+	{
+	    doc->stats->out->maxDepth = depth + 1;
+	}
+    }
+}
+
+static void
+buildAttribute(void *ctx, const char *name, size_t nameLen,
+	const char *value, size_t valueLen)
+{
+    XmlDoc *doc = ctx;
+    struct nodeBlock *b = doc->build;
+    XmlElement *element = b->elements + doc->current - 1;
+    const struct nameEntry *entry = internEntry(doc, name, nameLen);
+    XmlAttribute *attribute;
+    char *copy = 0;
+    size_t n;
+    struct attSpan *span;
+
+    if (!entry || (valueLen && !(copy = word(doc, value, valueLen))))
+    {
+	noMem(doc);
+	return;
+    }
+    if (b->spans)
+    {
+	/* up to the closing quote of a quoted value. A span left without
+	 * its attribute by running out of memory is never read. */
+	if (!(span = addAttSpan(doc, b)))
+	{
+	    noMem(doc);
+	    return;
+	}
+	span->start = name;
+	span->end = value + valueLen
+	    + (value[-1] == '"' || value[-1] == '\'');
+    }
+    if (!(attribute = addToRow(doc, element)))
+    {
+	noMem(doc);
+	return;
+    }
+    n = element->natts;
+    attribute->name = (char *)entry->name;
+    attribute->value = copy;
+    attribute->parent = element;
+    if (doc->stats) ++doc->stats->out->attributes;
+    if (n <= ATTTABLE_MIN) doc->attHashes[n - 1] = entry->hash;
+    if ((n == ATTTABLE_MIN && tableAttributes(doc, element,
+		    doc->attHashes) < 0)
+	    || (n > ATTTABLE_MIN
+		&& addAttribute(doc, element, n - 1, entry->hash) < 0))
+    {
+	noMem(doc);
+    }
+}
+
+static void
+buildText(void *ctx, const char *text, size_t len)
+{
+    XmlDoc *doc = ctx;
+    XmlElement *element = doc->build->elements + doc->current - 1;
+
+    if (doc->stats) ++doc->stats->out->texts;
+    appendString(doc, &(element->value), doc->values + element->depth,
+	    text, len);
+}
+
+static void
+buildEnd(void *ctx, const char *name, size_t nameLen)
+{
+    XmlDoc *doc = ctx;
+    struct nodeBlock *b = doc->build;
+    XmlElement *element = b->elements + doc->current - 1;
+
+    (void)name;
+    (void)nameLen;
+    if (b->spans) b->spans[doc->current - 1].end = doc->tagEnd;
+    doc->current = element->parent ? doc->current - element->parent : 0;
+}
+
+static const XmlHandler treeBuilder = {
+    buildStart,
+    buildAttribute,
+    buildText,
+    buildEnd
+};
+
+static void initDoc(XmlDoc *doc, const char *xmlText, size_t len);
+
+/* a new document allocating from allocator, or the global allocator if
+ * it is 0. Returns 0 (with errno set to ENOMEM) if memory ran out. */
+static XmlDoc *
+newDoc(const char *xmlText, size_t len, const XmlAllocator *allocator)
+{
+    struct arena arena;
+    XmlDoc *doc;
+
+    arenaInit(&arena, allocator);
+    if (!(doc = arenaAlloc(&arena, sizeof(XmlDoc))))
+    {
+	errno = ENOMEM;
+	return 0;
+    }
+    doc->arena = arena;
+    arenaInit(&doc->rows, &arena.allocator);
+    memset(&doc->spare, 0, sizeof doc->spare);
+    doc->names = &doc->ownNames;
+    doc->image = 0;
+    doc->retain = DOC_RETAIN;
+    initDoc(doc, xmlText, len);
+    return doc;
+}
+
+/* set up an empty document for xmlText */
+static void
+initDoc(XmlDoc *doc, const char *xmlText, size_t len)
+{
+    doc->ownNames.arena = &doc->arena;
+    doc->ownNames.entries = 0;
+    doc->ownNames.size = 0;
+    doc->ownNames.count = 0;
+    doc->root = 0;
+    doc->blocks = 0;
+    doc->build = 0;
+    doc->current = 0;
+    doc->tagIndex.size = 0;
+    doc->attIndex.size = 0;
+    doc->values = 0;
+    doc->valuesSize = 0;
+    doc->imageSize = 0;
+    doc->text = xmlText;
+    doc->end = xmlText + len;
+    doc->term = 0;
+    doc->termLines = 0;
+    doc->termLine = 0;
+    doc->inPlace = 0;
+    doc->spans = 1;
+    doc->tagEnd = 0;
+    doc->stats = 0;
+    doc->err = XML_SUCCESS;
+    doc->line = 1;
+    doc->textLine = 1;
+    doc->lineCarry = 0;
+}
+
+/* start collecting statistics of doc in out */
+static void
+initStats(XmlDoc *doc, XmlStats *out, int timing)
+{
+    memset(out, 0, sizeof *out);
+    if (!(doc->stats = arenaAlloc(&doc->arena, sizeof *doc->stats)))
+    {
+	noMem(doc);
+	return;
+    }
+    doc->stats->out = out;
+    doc->stats->timing = timing;
+    doc->stats->tempAllocs = 0;
+    doc->stats->tempBytes = 0;
+    doc->stats->tempPeak = 0;
+}
+
+/* forwards events to another handler, timing them */
+struct timedHandler
+{
+    const XmlHandler *handler;
+    void *ctx;
+    XmlStats *stats;
+};
+
+static void
+timedStart(void *ctx, const char *name, size_t nameLen)
+{
+    struct timedHandler *h = ctx;
+    double start = statsClock();
+
+    if (h->handler->startElement)
+    {
+	h->handler->startElement(h->ctx, name, nameLen);
+    }
+    h->stats->buildTime += statsClock() - start;
+}
+
+static void
+timedAttribute(void *ctx, const char *name, size_t nameLen,
+	const char *value, size_t valueLen)
+{
+    struct timedHandler *h = ctx;
+    double start = statsClock();
+
+    if (h->handler->attribute)
+    {
+	h->handler->attribute(h->ctx, name, nameLen, value, valueLen);
+    }
+    h->stats->buildTime += statsClock() - start;
+}
+
+static void
+timedText(void *ctx, const char *text, size_t len)
+{
+    struct timedHandler *h = ctx;
+    double start = statsClock();
+
+    if (h->handler->text) h->handler->text(h->ctx, text, len);
+    h->stats->buildTime += statsClock() - start;
+}
+
+static void
+timedEnd(void *ctx, const char *name, size_t nameLen)
+{
+    struct timedHandler *h = ctx;
+    double start = statsClock();
+
+    if (h->handler->endElement) h->handler->endElement(h->ctx, name, nameLen);
+    h->stats->buildTime += statsClock() - start;
+}
+
+static const XmlHandler timedEvents = {
+    timedStart,
+    timedAttribute,
+    timedText,
+    timedEnd
+};
+
+/* tokenize from pos to the end of the text, counting the bytes scanned
+ * and, with timing, splitting the time between scanning and the handler */
+static void
+scan(struct tokenizer *t, const char *pos)
+{
+    XmlDoc *doc = t->doc;
+    XmlStats *stats;
+    struct timedHandler timed;
+    double build;
+    double start;
+
+    if (!doc->stats)
+    {
+	tokenize(t, pos);
+	return;
+    }
+    stats = doc->stats->out;
+    stats->bytes += (size_t)(doc->end - pos);
+    if (!doc->stats->timing)
+    {
+	tokenize(t, pos);
+	return;
+    }
+    timed.handler = t->handler;
+    timed.ctx = t->ctx;
+    timed.stats = stats;
+    t->handler = &timedEvents;
+    t->ctx = &timed;
+    build = stats->buildTime;
+    start = statsClock();
+    tokenize(t, pos);
+    stats->scanTime += statsClock() - start - (stats->buildTime - build);
+    t->handler = timed.handler;
+    t->ctx = timed.ctx;
+}
+
+/* build the tree of doc from its text, skipping content below lazyDepth
+ * if it isn't 0 */
+static void
+parseTree(XmlDoc *doc, size_t lazyDepth)
+{
+    struct tokenizer t;
+
+    initTokenizer(&t, doc, &treeBuilder, doc);
+    t.lazyDepth = lazyDepth;
+    scan(&t, doc->text);
+    doneTokenizer(&t);
+    flushTerm(doc);
+}
+
+/* finish the block built by parsing, its first element is the root */
+static void
+finishBuild(XmlDoc *doc)
+{
+    if (!doc->build) return;
+    finishBlock(doc, doc->build);
+    doc->root = doc->build->elements;
+    doc->build = 0;
+}
+
+static void
+finishTree(XmlDoc *doc)
+{
+    finishBuild(doc);
+    if (doc->err != XML_SUCCESS) doc->root = 0;
+    if (doc->stats) updateStats(doc);
+}
+
+static XmlDoc *parseProjected(const char *xmlText, size_t len,
+	const XmlParseOptions *options);
+
+static XmlDoc *
+parse(const char *xmlText, size_t len, int inPlace,
+	const XmlParseOptions *options)
+{
+    XmlDoc *doc;
+    XmlParseOptions eager;
+
+    if (options && options->keep)
+    {
+	return parseProjected(xmlText, len, options);
+    }
+    doc = newDoc(xmlText, len, options ? options->allocator : 0);
+    if (!doc) return 0;
+    doc->inPlace = inPlace;
+    doc->spans = !inPlace;
+    if (options && options->names) doc->names = options->names;
+    if (options && options->stats)
+    {
+	initStats(doc, options->stats, options->timing);
+    }
+    parseTree(doc, options && options->lazy);
+    if (doc->err != XML_SUCCESS && doc->err != XML_NOMEM
+	    && options && options->lazy)
+    {
+	/* the error may come from content skipped with mismatched names,
+	 * parse again without skipping to find the first one */
+	freeDoc(doc);
+	eager = *options;
+	eager.lazy = 0;
+	return parse(xmlText, len, inPlace, &eager);
+    }
+    finishTree(doc);
+    return doc;
+}
+
+static const XmlHandler noEvents = { 0, 0, 0, 0 };
+
+/* tokenize the deferred content of e, continuing as the tokenizer parsing
+ * the whole document would */
+static void
+tokenizeContent(XmlElement *e, const struct lazyContent *lc,
+	const XmlHandler *handler, size_t lazyDepth)
+{
+    XmlDoc *doc = lc->doc;
+    struct tokenizer t;
+
+    doc->err = XML_SUCCESS;
+    initTokenizer(&t, doc, handler, doc);
+    t.state = TS_CONTENT;
+    t.hasRoot = 1;
+    t.lazyDepth = lazyDepth;
+    pushName(&t, e->name, strlen(e->name));
+    scan(&t, lc->start);
+    doneTokenizer(&t);
+}
+
+/* parse the deferred content of e. A document keeps its first error. */
+static void
+parseContent(XmlElement *e, const struct lazyContent *lc,
+	const XmlHandler *handler, size_t lazyDepth)
+{
+    XmlDoc *doc = lc->doc;
+    const char *end = doc->end;
+    XmlError err = doc->err;
+    union xmlErrInfo errInfo = doc->errInfo;
+    long line = doc->line;
+    long col = doc->col;
+
+    doc->end = lc->end;
+    tokenizeContent(e, lc, handler, lazyDepth);
+
+    /* mismatched names in skipped content can make the error show up
+     * elsewhere, so find it again without skipping */
+    if (doc->err != XML_SUCCESS && doc->err != XML_NOMEM && lazyDepth)
+    {
+	tokenizeContent(e, lc, &noEvents, 0);
+    }
+    doc->end = end;
+    if (err != XML_SUCCESS)
+    {
+	doc->err = err;
+	doc->errInfo = errInfo;
+	doc->line = line;
+	doc->col = col;
+    }
+}
+
+/* build the children and content of e, deferring the content of the
+ * children in turn. They go to a block of their own, below a stand-in for
+ * e that is dropped again if there are none. */
+static void
+materialize(XmlElement *e)
+{
+    struct lazyContent *lc = (struct lazyContent *)(void *)e->value;
+    XmlDoc *doc = lc->doc;
+    struct nodeBlock *b = newBlock(doc);
+    XmlElement *stub;
+
+    e->lazy = 0;
+    doc->build = b;
+    doc->current = 0;
+    if (!b || !(stub = newElement(doc, 0)))
+    {
+	/* e stays empty */
+	e->value = 0;
+	doc->build = 0;
+	if (b)
+	{
+	    doc->blocks = b->next;
+	    releaseBlock(doc, b);
+	}
+	noMem(doc);
+	return;
+    }
+    stub->name = e->name;
+    stub->depth = e->depth;
+    parseContent(e, lc, &treeBuilder, 2);
+    finishBlock(doc, b);
+    doc->build = 0;
+    stub = b->elements;
+    if (stub->last)
+    {
+	lc->value = stub->value;
+	lc->children = stub;
+	stub->stub = 1;
+	stub->value = (char *)e;
+	e->external = 1;
+    }
+    else
+    {
+	e->value = stub->value;
+	doc->blocks = b->next;
+	releaseBlock(doc, b);
+    }
+}
+
+struct XmlPushParser
+{
+    XmlDoc *doc;
+    struct tokenizer t;
+};
+
+XmlPushParser *
+xmlPushParserNew(const XmlHandler *handler, void *ctx)
+{
+    XmlDoc *doc = newDoc("", 0, 0);
+    XmlPushParser *p;
+
+    if (!doc) return 0;
+    if (!(p = allocMem(docAllocator(doc), sizeof(XmlPushParser))))
+    {
+	freeDoc(doc);
+	errno = ENOMEM;
+	return 0;
+    }
+    p->doc = doc;
+    doc->spans = 0;
+    if (handler) initTokenizer(&p->t, p->doc, handler, ctx);
+    else initTokenizer(&p->t, p->doc, &treeBuilder, p->doc);
+    p->t.final = 0;
+    return p;
+}
+
+static void
+pushChunk(XmlPushParser *p, const char *chunk, size_t n)
+{
+    XmlDoc *doc = p->doc;
+
+    doc->text = chunk;
+    doc->end = chunk + n;
+    tokenize(&p->t, chunk);
+
+    /* positions in the chunk are only known until it's gone */
+    if (p->t.mark)
+    {
+	position(doc, p->t.mark, &p->t.markLine, &p->t.markCol);
+	p->t.mark = 0;
+    }
+    position(doc, doc->end, &doc->textLine, &doc->lineCarry);
+    --doc->lineCarry;
+}
+
+XmlError
+xmlPushFeed(XmlPushParser *p, const char *chunk, size_t n)
+{
+    if (p->doc->err == XML_SUCCESS && n) pushChunk(p, chunk, n);
+    return p->doc->err;
+}
+
+XmlDoc *
+xmlPushFinish(XmlPushParser *p)
+{
+    XmlDoc *doc = p->doc;
+
+    if (doc->err == XML_SUCCESS)
+    {
+	p->t.final = 1;
+	pushChunk(p, "", 0);
+    }
+    doneTokenizer(&p->t);
+    releaseMem(docAllocator(doc), p, sizeof *p);
+    finishBuild(doc);
+    if (doc->err != XML_SUCCESS) doc->root = 0;
+    doc->text = doc->end = 0;
+    return doc;
+}
+
+XmlDoc *
+xmlParseEvents(const char *xmlText, size_t len,
+	const XmlHandler *handler, void *ctx)
+{
+    XmlDoc *doc = newDoc(xmlText, len, 0);
+    struct tokenizer t;
+
+    if (!doc) return 0;
+    initTokenizer(&t, doc, handler, ctx);
+    tokenize(&t, xmlText);
+    doneTokenizer(&t);
+    return doc;
+}
+
+XmlDoc *
+parseDoc(const char *xmlText)
+{
+    return parse(xmlText, strlen(xmlText), 0, 0);
+}
+
+XmlDoc *
+parseDocN(const char *xmlText, size_t len)
+{
+    return parse(xmlText, len, 0, 0);
+}
+
+XmlDoc *
+parseDocInPlace(char *buf, size_t len)
+{
+    return parse(buf, len, 1, 0);
+}
+
+XmlDoc *
+parseDocWith(const char *xmlText, size_t len, const XmlParseOptions *options)
+{
+    return parse(xmlText, len, 0, options);
+}
+
+void
+xmlDocReset(XmlDoc *doc)
+{
+    struct arenaChunk *keep;
+    struct nodeBlock *b;
+    struct nodeBlock spare = doc->spare;
+    XmlStats *stats = doc->stats ? doc->stats->out : 0;
+    int timing = doc->stats ? doc->stats->timing : 0;
+    size_t budget = doc->retain;
+    size_t bytes;
+
+    releaseImage(doc);
+
+    /* the arrays of the largest block are kept if they fit the budget */
+    for (b = doc->blocks; b; b = b->next) if (!b->image)
+    {
+	if (b->size > spare.size)
+	{
+	    releaseBlock(doc, &spare);
+	    spare = *b;
+	}
+	else releaseBlock(doc, b);
+    }
+    bytes = spare.size * sizeof *spare.elements + spare.attsSize
+	* sizeof *spare.attSpans;
+    if (spare.elements) bytes += BLOCK_HEAD;
+    if (spare.spans) bytes += spare.size * sizeof *spare.spans;
+    if (bytes > budget)
+    {
+	releaseBlock(doc, &spare);
+	memset(&spare, 0, sizeof spare);
+    }
+    else budget -= bytes;
+    spare.count = spare.natts = 0;
+    spare.moved = 0;
+    spare.allocs = spare.allocated = 0;
+    spare.next = 0;
+
+    /* the document itself is at the start of one of its chunks */
+    for (keep = doc->arena.chunks; (void *)keep->data != (void *)doc;
+	    keep = keep->next);
+    arenaRecycle(&doc->arena, keep, &budget);
+    arenaRecycle(&doc->rows, 0, &budget);
+    keep->used = ARENA_ALIGNED(sizeof(XmlDoc));
+    doc->spare = spare;
+    initDoc(doc, "", 0);
+    if (stats) initStats(doc, stats, timing);
+}
+
+XmlError
+parseDocInto(XmlDoc *doc, const char *xmlText, size_t len)
+{
+    xmlDocReset(doc);
+    doc->text = xmlText;
+    doc->end = xmlText + len;
+    parseTree(doc, 0);
+    finishTree(doc);
+    return doc->err;
+}
+
+void
+xmlDocSetRetainLimit(XmlDoc *doc, size_t bytes)
+{
+    doc->retain = bytes;
+}
+
+XmlNameTable *
+xmlNameTableNew(void)
+{
+    struct arena arena;
+    XmlNameTable *t;
+
+    arenaInit(&arena, 0);
+    if (!(t = arenaAlloc(&arena, sizeof(XmlNameTable))))
+    {
+	errno = ENOMEM;
+	return 0;
+    }
+    t->ownArena = arena;
+    t->arena = &t->ownArena;
+    t->entries = 0;
+    t->size = 0;
+    t->count = 0;
+    return t;
+}
+
+void
+xmlNameTableFree(XmlNameTable *names)
+{
+    /* like a document, the table lives in its first arena chunk */
+    if (names) arenaFree(&names->ownArena);
+}
+
+const char *
+xmlInternName(XmlDoc *doc, const char *name)
+{
+    return internName(doc, name, strlen(name));
+}
+
+#ifdef WIN32
+XmlDoc *
+parseFile(const char *path)
+{
+    XmlDoc *doc;
+    FILE *file;
+    char *buf;
+    long size;
+
+    if (!(file = fopen(path, "rb"))) return 0;
+    if (fseek(file, 0, SEEK_END) < 0 || (size = ftell(file)) < 0
+	    || fseek(file, 0, SEEK_SET) < 0)
+    {
+	fclose(file);
+	return 0;
+    }
+    if (!(buf = allocMem(&globalAllocator, (size_t)size + 1)))
+    {
+	fclose(file);
+	errno = ENOMEM;
+	return 0;
+    }
+    if (fread(buf, 1, (size_t)size, file) != (size_t)size)
+    {
+	releaseMem(&globalAllocator, buf, (size_t)size + 1);
+	fclose(file);
+	return 0;
+    }
+    fclose(file);
+    doc = parseDocN(buf, (size_t)size);
+    releaseMem(&globalAllocator, buf, (size_t)size + 1);
+    return doc;
+}
+#else
+XmlDoc *
+parseFile(const char *path)
+{
+    XmlDoc *doc;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) return 0;
+    if (fstat(fd, &st) < 0)
+    {
+	close(fd);
+	return 0;
+    }
+    if (!st.st_size)
+    {
+	close(fd);
+	return parseDocN("", 0);
+    }
+    map = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    /* the document holds copies of everything it needs, so the mapping is
+     * only used while parsing */
+    doc = parseDocN(map, (size_t)st.st_size);
+    munmap(map, (size_t)st.st_size);
+    return doc;
+}
+#endif
+
+/* next element after e in document order, not leaving the subtree of top.
+ * Walking the tree this way needs neither recursion nor a stack. */
+static const XmlElement *
+nextElement(const XmlElement *e, const XmlElement *top)
+{
+    const XmlElement *next;
+
+    MATERIALIZE(e);
+    if ((next = childOf(e))) return next;
+    while (e != top)
+    {
+	if (e->next) return e + e->next;
+	e = parentOf(e);
+    }
+    return 0;
+}
+
+/* threads for parseDocParallel() and xmlParseBatch(). If a thread can't
+ * be started, its work is done by the caller. */
+struct xmlThread
+{
+    void (*run)(void *);
+    void *arg;
+    int started;
+#ifdef WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+};
+
+#ifdef WIN32
+typedef CRITICAL_SECTION xmlMutex;
+#define initMutex(m) InitializeCriticalSection(m)
+#define doneMutex(m) DeleteCriticalSection(m)
+#define lockMutex(m) EnterCriticalSection(m)
+#define unlockMutex(m) LeaveCriticalSection(m)
+
+static DWORD WINAPI
+threadMain(LPVOID arg)
+#else
+typedef pthread_mutex_t xmlMutex;
+#define initMutex(m) pthread_mutex_init((m), 0)
+#define doneMutex(m) pthread_mutex_destroy(m)
+#define lockMutex(m) pthread_mutex_lock(m)
+#define unlockMutex(m) pthread_mutex_unlock(m)
+
+static void *
+threadMain(void *arg)
+#endif
+{
+    struct xmlThread *t = arg;
+
+    t->run(t->arg);
+    return 0;
+}
+
+static void
+startThread(struct xmlThread *t, void (*run)(void *), void *arg)
+{
+    t->run = run;
+    t->arg = arg;
+#ifdef WIN32
+    t->handle = CreateThread(0, 0, threadMain, t, 0, 0);
+    t->started = t->handle != 0;
+#else
+    t->started = !pthread_create(&t->handle, 0, threadMain, t);
+#endif
+    if (!t->started) run(arg);
+}
+
+static void
+joinThread(struct xmlThread *t)
+{
+    if (!t->started) return;
+#ifdef WIN32
+    WaitForSingleObject(t->handle, INFINITE);
+    CloseHandle(t->handle);
+#else
+    pthread_join(t->handle, 0);
+#endif
+    t->started = 0;
+}
+
+/* parallel parsing: the content of the root element is split between its
+ * children into ranges of about equal size. Each range is parsed by its own
+ * thread into its own document (with its own arena and name table) below a
+ * stand-in for the root element, then the pieces are moved into the main
+ * document.
+ *
+ * To find the ranges, the content is cut into chunks scanned in parallel,
+ * only looking at tag boundaries. Each chunk records where its relative
+ * nesting depth first reaches every level below its start, so once the
+ * depth at the start of each chunk is known, the first end of a child of
+ * the root in it can be looked up. The tokenizer of every range checks it
+ * ends where the next one starts. If that fails or there is any error, the
+ * document is parsed again serially, so results and errors are always those
+ * of parseDocN(). */
+#define PARALLEL_MINRANGE (256 * 1024)
+
+enum rangeTask
+{
+    RT_SCAN,
+    RT_PARSE,
+    RT_REMAP
+};
+
+struct parseRange
+{
+    enum rangeTask task;
+    XmlDoc *main;
+    XmlDoc *doc;
+    XmlElement *top;
+    const char *start;
+    const char *end;
+    const char *rootName;
+    size_t rootNameLen;
+    long depth;
+    long minDepth;
+    const char *returned;
+    const char **lowered;
+    size_t loweredSize;
+    const char **mapFrom;
+    char **mapTo;
+    size_t mapSize;
+    int ok;
+
+    /* memory ran out while scanning */
+    int failed;
+    struct xmlThread thread;
+};
+
+/* skip a tag starting at its name, return the position after '>' or 0 */
+static const char *
+scanTag(const char *pos, const char *end, int *empty)
+{
+    while (pos != end && !isWs(*pos) && *pos != '>') ++pos;
+    *empty = 0;
+    for (; pos != end; ++pos)
+    {
+	if (*pos == '>') return pos + 1;
+	if (*pos == '"' || *pos == '\'')
+	{
+	    pos = memchr(pos + 1, *pos, (size_t)(end - pos - 1));
+	    if (!pos) return 0;
+	    *empty = 0;
+	}
+	else if (*pos == '/') *empty = 1;
+	else if (!isWs(*pos)) *empty = 0;
+    }
+    return 0;
+}
+
+/* position after the opening tag of the root element, or 0 */
+static const char *
+findRoot(const char *pos, const char *end)
+{
+    int empty;
+
+    while (1)
+    {
+	while (pos != end && isWs(*pos)) ++pos;
+	if (pos == end || *pos != '<' || ++pos == end) return 0;
+	if (*pos != '!' && *pos != '?') break;
+	if (!(pos = memchr(pos, '>', (size_t)(end - pos)))) return 0;
+	++pos;
+    }
+    if (*pos == '/' || !(pos = scanTag(pos, end, &empty)) || empty) return 0;
+    return pos;
+}
+
+/* a tag of a chunk ends at pos, with r->depth relative to the chunk start */
+static void
+scanned(struct parseRange *r, const char *pos)
+{
+    const char **lowered;
+
+    if (!r->depth && !r->returned) r->returned = pos;
+    else if (r->depth < r->minDepth)
+    {
+	r->minDepth = r->depth;
+	if ((size_t)-r->depth > r->loweredSize)
+	{
+	    lowered = resizeMem(&globalAllocator, r->lowered,
+		    r->loweredSize * sizeof *r->lowered,
+		    (r->loweredSize ? r->loweredSize * 2 : 64)
+		    * sizeof *r->lowered);
+	    if (!lowered)
+	    {
+		r->failed = 1;
+		return;
+	    }
+	    r->lowered = lowered;
+	    r->loweredSize = r->loweredSize ? r->loweredSize * 2 : 64;
+	}
+	r->lowered[-r->depth - 1] = pos;
+    }
+}
+
+/* scan the tags starting in a chunk, the content of the root element ends
+ * at r->main->end */
+static void
+scanChunk(struct parseRange *r)
+{
+    const char *end = r->main->end;
+    const char *pos = r->start;
+    int empty;
+
+    while ((pos = memchr(pos, '<', (size_t)(end - pos))) && pos < r->end
+	    && !r->failed)
+    {
+	if (++pos == end) break;
+	if (*pos == '/')
+	{
+	    if (!(pos = memchr(pos, '>', (size_t)(end - pos)))) break;
+	    ++pos;
+	    --r->depth;
+	}
+	else
+	{
+	    if (!(pos = scanTag(pos, end, &empty))) break;
+	    if (!empty)
+	    {
+		++r->depth;
+		continue;
+	    }
+	}
+	scanned(r, pos);
+    }
+}
+
+/* the first end of a child of the root element in a chunk starting at the
+ * given depth, or 0 */
+static const char *
+childEnd(const struct parseRange *r, long depth)
+{
+    if (depth == 1)
+    {
+	/* not when the root element is closed before */
+	if (r->minDepth < 0 && r->returned > r->lowered[0]) return 0;
+	return r->returned;
+    }
+    if (depth - 1 > -r->minDepth) return 0;
+    return r->lowered[depth - 2];
+}
+
+/* a range must end directly inside the root element, with nothing left */
+static int
+atRootLevel(const struct tokenizer *t)
+{
+    return t->doc->err == XML_SUCCESS && t->state == TS_CONTENT
+	&& t->depth == 1 && !t->tokLen;
+}
+
+/* a range that runs out of memory is not ok, the document is then parsed
+ * serially, which reports it */
+static void
+parseRangeContent(struct parseRange *r)
+{
+    XmlDoc *doc = newDoc(r->start, (size_t)(r->end - r->start), 0);
+    XmlElement *root;
+    struct tokenizer t;
+
+    if (!doc) return;
+    r->doc = doc;
+    doc->valuesSize = 16;
+    doc->values = arenaAlloc(&doc->arena,
+	    doc->valuesSize * sizeof *doc->values);
+    if (!doc->values || !(root = newElement(doc, 0))) return;
+    root->name = (char *)r->rootName;
+
+    /* continue as the tokenizer parsing the whole document would */
+    initTokenizer(&t, doc, &treeBuilder, doc);
+    t.state = TS_CONTENT;
+    t.hasRoot = 1;
+    t.final = 0;
+    pushName(&t, r->rootName, r->rootNameLen);
+    tokenize(&t, r->start);
+    r->ok = atRootLevel(&t);
+    doneTokenizer(&t);
+    r->top = doc->build->elements;
+}
+
+/* map the names of a range to the names of the main document, by pointer.
+ * Returns -1 if memory ran out. */
+static int
+mapNames(struct parseRange *r)
+{
+    const XmlNameTable *names = &r->doc->ownNames;
+    const struct nameEntry *e;
+    size_t i, j;
+
+    r->mapSize = names->size;
+    if (!r->mapSize) return 0;
+    r->mapFrom = allocMem(&globalAllocator, r->mapSize * sizeof *r->mapFrom);
+    r->mapTo = allocMem(&globalAllocator, r->mapSize * sizeof *r->mapTo);
+    if (!r->mapFrom || !r->mapTo) return -1;
+    memset(r->mapFrom, 0, r->mapSize * sizeof *r->mapFrom);
+    for (i = 0; i < names->size; ++i) if ((e = names->entries + i)->name)
+    {
+	for (j = hashPointer(e->name) & (r->mapSize - 1); r->mapFrom[j];
+		j = (j + 1) & (r->mapSize - 1));
+	r->mapFrom[j] = e->name;
+	if (!(r->mapTo[j] = internName(r->main, e->name, e->len))) return -1;
+    }
+    return 0;
+}
+
+static char *
+mappedName(const struct parseRange *r, const char *name)
+{
+    size_t i;
+
+    for (i = hashPointer(name) & (r->mapSize - 1); r->mapFrom[i] != name;
+	    i = (i + 1) & (r->mapSize - 1));
+    return r->mapTo[i];
+}
+
+static void
+remapRange(struct parseRange *r)
+{
+    XmlElement *e, *end;
+    XmlAttribute *a, *aend;
+
+    for (e = r->top + 1, end = r->top + r->doc->build->count; e != end; ++e)
+    {
+	e->name = mappedName(r, e->name);
+	for (a = e->attributes, aend = a + e->natts; a != aend; ++a)
+	{
+	    a->name = mappedName(r, a->name);
+	}
+    }
+}
+
+static void
+runRange(void *arg)
+{
+    struct parseRange *r = arg;
+
+    switch (r->task)
+    {
+	case RT_SCAN:
+	    scanChunk(r);
+	    break;
+
+	case RT_PARSE:
+	    parseRangeContent(r);
+	    break;
+
+	case RT_REMAP:
+	    remapRange(r);
+	    break;
+    }
+}
+
+/* append the elements of a block but its first to another block, the
+ * children of the first element of from become children of the first
+ * element of to. prev is the last of these so far, the new last one is
+ * returned. */
+static XmlElement *
+joinBlock(struct nodeBlock *to, const struct nodeBlock *from,
+	XmlElement *prev)
+{
+    XmlElement *e = to->elements + to->count;
+    size_t skip = from->elements->natts;
+    size_t i;
+
+    if (from->count < 2) return prev;
+    memcpy(e, from->elements + 1, (from->count - 1) * sizeof *e);
+    if (to->spans)
+    {
+	memcpy(to->spans + to->count, from->spans + 1,
+		(from->count - 1) * sizeof *to->spans);
+	if (from->natts > skip)
+	{
+	    memcpy(to->attSpans + to->natts, from->attSpans + skip,
+		    (from->natts - skip) * sizeof *to->attSpans);
+	}
+    }
+    for (i = 1; i < from->count; ++i, ++e)
+    {
+	if (e->parent == i)
+	{
+	    e->parent = (unsigned int)to->count;
+	    if (prev) prev->next = (unsigned int)(e - prev);
+	    prev = e;
+	}
+	e->index = (unsigned int)to->count;
+	if (to->spans)
+	{
+	    to->spans[to->count].firstAtt += to->natts - skip;
+	}
+	++to->count;
+    }
+    to->natts += from->natts - skip;
+    return prev;
+}
+
+/* move the children, content and arenas of all ranges to the main
+ * document. Their elements are copied behind the root element, before its
+ * children parsed by the main document. Returns -1 and changes nothing if
+ * memory ran out. */
+static int
+joinRanges(XmlDoc *doc, struct parseRange *ranges, size_t n)
+{
+    const XmlAllocator *allocator = docAllocator(doc);
+    struct nodeBlock *b = doc->build;
+    struct nodeBlock joined;
+    XmlElement *root = b->elements;
+    XmlElement *last = 0;
+    char *value = root->value;
+    char *joinedValue = 0;
+    char *mem;
+    size_t valueLen = value ? doc->values[0].len : 0;
+    size_t len = valueLen;
+    size_t i;
+
+    memset(&joined, 0, sizeof joined);
+    joined.size = b->count;
+    joined.attsSize = b->natts;
+    for (i = 0; i < n; ++i)
+    {
+	joined.size += ranges[i].doc->build->count - 1;
+	joined.attsSize += ranges[i].doc->build->natts;
+	if (ranges[i].top->value) len += ranges[i].doc->values[0].len;
+    }
+    mem = allocMem(allocator,
+	    BLOCK_HEAD + joined.size * sizeof *joined.elements);
+    if (b->spans)
+    {
+	joined.spans = allocMem(allocator, joined.size * sizeof *joined.spans);
+	if (joined.attsSize)
+	{
+	    joined.attSpans = allocMem(allocator,
+		    joined.attsSize * sizeof *joined.attSpans);
+	}
+    }
+    if (len != valueLen) joinedValue = arenaAlloc(&doc->arena, len + 1);
+    if (!mem || (b->spans && (!joined.spans
+		    || (joined.attsSize && !joined.attSpans)))
+	    || (len != valueLen && !joinedValue))
+    {
+	releaseMem(allocator, mem,
+		BLOCK_HEAD + joined.size * sizeof *joined.elements);
+	releaseMem(allocator, joined.spans,
+		joined.size * sizeof *joined.spans);
+	releaseMem(allocator, joined.attSpans,
+		joined.attsSize * sizeof *joined.attSpans);
+	return -1;
+    }
+    joined.elements = (XmlElement *)(void *)(mem + BLOCK_HEAD);
+    ((struct nodeBlock **)(void *)joined.elements)[-1] = b;
+    ++b->allocs;
+    b->allocated += BLOCK_HEAD + joined.size * sizeof *joined.elements;
+    if (b->spans)
+    {
+	++b->allocs;
+	b->allocated += joined.size * sizeof *joined.spans;
+	if (joined.attsSize)
+	{
+	    ++b->allocs;
+	    b->allocated += joined.attsSize * sizeof *joined.attSpans;
+	}
+	joined.spans[0] = b->spans[0];
+	if (root->natts)
+	{
+	    memcpy(joined.attSpans, b->attSpans,
+		    root->natts * sizeof *joined.attSpans);
+	}
+    }
+    joined.elements[0] = *root;
+    joined.count = 1;
+    joined.natts = root->natts;
+    for (i = 0; i < n; ++i)
+    {
+	last = joinBlock(&joined, ranges[i].doc->build, last);
+    }
+    last = joinBlock(&joined, b, last);
+    releaseBlock(doc, b);
+    b->elements = joined.elements;
+    b->count = b->size = joined.count;
+    b->spans = joined.spans;
+    b->attSpans = joined.attSpans;
+    b->natts = b->attsSize = joined.natts;
+    b->moved = 1;
+    root = b->elements;
+    root->last = last ? (unsigned int)(last - root) : 0;
+
+    if (len != valueLen)
+    {
+	root->value = joinedValue;
+	for (len = 0, i = 0; i < n; ++i) if (ranges[i].top->value)
+	{
+	    memcpy(root->value + len, ranges[i].top->value,
+		    ranges[i].doc->values[0].len);
+	    len += ranges[i].doc->values[0].len;
+	}
+	if (value) memcpy(root->value + len, value, valueLen);
+	root->value[len + valueLen] = '\0';
+    }
+
+    /* chunks of the ranges go behind the current chunk of the document,
+     * their elements have been copied */
+    for (i = 0; i < n; ++i)
+    {
+	releaseBlock(ranges[i].doc, ranges[i].doc->build);
+	arenaJoin(&doc->rows, &ranges[i].doc->rows);
+	arenaJoin(&doc->arena, &ranges[i].doc->arena);
+	ranges[i].doc = 0;
+    }
+    return 0;
+}
+
+XmlDoc *
+parseDocParallel(const char *xmlText, size_t len, int nthreads)
+{
+    XmlDoc *doc;
+    struct tokenizer t;
+    struct parseRange *ranges;
+    const char **starts;
+    const char *end = xmlText + len;
+    const char *content;
+    size_t n = nthreads > 1 ? (size_t)nthreads : 1;
+    size_t chunkLen;
+    size_t i, nranges;
+    long depth;
+    int ok;
+
+    if (n > len / PARALLEL_MINRANGE) n = len / PARALLEL_MINRANGE;
+    if (n < 2 || !(content = findRoot(xmlText, end)))
+    {
+	return parse(xmlText, len, 0, 0);
+    }
+
+    /* parse up to the end of the opening tag of the root element */
+    if (!(doc = newDoc(xmlText, (size_t)(content - xmlText), 0)))
+    {
+	return parse(xmlText, len, 0, 0);
+    }
+    initTokenizer(&t, doc, &treeBuilder, doc);
+    t.final = 0;
+    tokenize(&t, xmlText);
+    doc->end = end;
+    if (!atRootLevel(&t))
+    {
+	doneTokenizer(&t);
+	freeDoc(doc);
+	return parse(xmlText, len, 0, 0);
+    }
+
+    /* without memory for splitting, the document is parsed serially */
+    ranges = allocMem(&globalAllocator, n * sizeof *ranges);
+    starts = allocMem(&globalAllocator, n * sizeof *starts);
+    if (!ranges || !starts)
+    {
+	releaseMem(&globalAllocator, ranges, n * sizeof *ranges);
+	releaseMem(&globalAllocator, starts, n * sizeof *starts);
+	doneTokenizer(&t);
+	freeDoc(doc);
+	return parse(xmlText, len, 0, 0);
+    }
+    memset(ranges, 0, n * sizeof *ranges);
+    chunkLen = (size_t)(end - content) / n;
+    for (i = 0; i < n; ++i)
+    {
+	ranges[i].task = RT_SCAN;
+	ranges[i].main = doc;
+	ranges[i].start = content + i * chunkLen;
+	ranges[i].end = i == n - 1 ? end : ranges[i].start + chunkLen;
+	startThread(&ranges[i].thread, runRange, ranges + i);
+    }
+    for (i = 0; i < n; ++i) joinThread(&ranges[i].thread);
+
+    /* ranges start in the chunks where a child of the root element ends */
+    starts[0] = content;
+    nranges = 1;
+    depth = 1;
+    for (i = 0; i < n; ++i) if (ranges[i].failed) depth = 0;
+    for (i = 0; i < n && depth > 0; ++i)
+    {
+	if (i && (starts[nranges] = childEnd(ranges + i, depth))
+		&& starts[nranges] > starts[nranges-1]) ++nranges;
+	if (depth + ranges[i].minDepth <= 0) break;
+	depth += ranges[i].depth;
+    }
+    for (i = 0; i < n; ++i)
+    {
+	releaseMem(&globalAllocator, ranges[i].lowered,
+		ranges[i].loweredSize * sizeof *ranges[i].lowered);
+    }
+    memset(ranges, 0, n * sizeof *ranges);
+
+    for (i = 0; i < nranges - 1; ++i)
+    {
+	ranges[i].task = RT_PARSE;
+	ranges[i].main = doc;
+	ranges[i].start = starts[i];
+	ranges[i].end = starts[i+1];
+	ranges[i].rootName = doc->build->elements->name;
+	ranges[i].rootNameLen = strlen(doc->build->elements->name);
+	startThread(&ranges[i].thread, runRange, ranges + i);
+    }
+
+    /* the last range is parsed here, up to the end of the document */
+    t.final = 1;
+    tokenize(&t, starts[nranges-1]);
+    doneTokenizer(&t);
+    ok = doc->err == XML_SUCCESS;
+    for (i = 0; i < nranges - 1; ++i)
+    {
+	joinThread(&ranges[i].thread);
+	ok = ok && ranges[i].ok;
+    }
+
+    /* interning is serial, replacing names in the trees is not */
+    for (i = 0; ok && i < nranges - 1; ++i) ok = mapNames(ranges + i) == 0;
+    if (ok)
+    {
+	for (i = 0; i < nranges - 1; ++i)
+	{
+	    ranges[i].task = RT_REMAP;
+	    startThread(&ranges[i].thread, runRange, ranges + i);
+	}
+	for (i = 0; i < nranges - 1; ++i) joinThread(&ranges[i].thread);
+	ok = joinRanges(doc, ranges, nranges - 1) == 0;
+    }
+
+    for (i = 0; i < nranges - 1; ++i)
+    {
+	freeDoc(ranges[i].doc);
+	releaseMem(&globalAllocator, ranges[i].mapFrom,
+		ranges[i].mapSize * sizeof *ranges[i].mapFrom);
+	releaseMem(&globalAllocator, ranges[i].mapTo,
+		ranges[i].mapSize * sizeof *ranges[i].mapTo);
+    }
+    releaseMem(&globalAllocator, ranges, n * sizeof *ranges);
+    releaseMem(&globalAllocator, starts, n * sizeof *starts);
+
+    /* with a single range, this was a serial parse already */
+    if (ok || nranges == 1)
+    {
+	finishTree(doc);
+	return doc;
+    }
+    freeDoc(doc);
+    return parse(xmlText, len, 0, 0);
+}
+
+/* batches of documents: threads take the next unparsed document until none
+ * is left, so long and short documents even out */
+struct parseBatch
+{
+    const char **texts;
+    const size_t *lens;
+    size_t n;
+    size_t next;
+    XmlDoc **out;
+    XmlBatchCallback callback;
+    void *ctx;
+    xmlMutex lock;
+};
+
+static void
+parseBatchDoc(struct parseBatch *b, size_t i)
+{
+    XmlDoc *doc;
+    size_t len;
+
+    len = b->lens ? b->lens[i] : strlen(b->texts[i]);
+    doc = parse(b->texts[i], len, 0, 0);
+    if (b->callback) b->callback(b->ctx, i, doc);
+    else b->out[i] = doc;
+}
+
+static void
+runBatch(void *arg)
+{
+    struct parseBatch *b = arg;
+    size_t i;
+
+    while (1)
+    {
+	lockMutex(&b->lock);
+	i = b->next < b->n ? b->next++ : b->n;
+	unlockMutex(&b->lock);
+	if (i == b->n) return;
+	parseBatchDoc(b, i);
+    }
+}
+
+static void
+parseBatch(struct parseBatch *b, int nthreads)
+{
+    struct xmlThread *threads;
+    size_t n = nthreads > 1 ? (size_t)nthreads : 1;
+    size_t i;
+
+    if (n > b->n) n = b->n;
+    if (n < 2 || !(threads = allocMem(&globalAllocator,
+		    (n - 1) * sizeof *threads)))
+    {
+	for (i = 0; i < b->n; ++i) parseBatchDoc(b, i);
+	return;
+    }
+
+    /* the calling thread is one of the workers */
+    initMutex(&b->lock);
+    for (i = 0; i < n - 1; ++i) startThread(threads + i, runBatch, b);
+    runBatch(b);
+    for (i = 0; i < n - 1; ++i) joinThread(threads + i);
+    releaseMem(&globalAllocator, threads, (n - 1) * sizeof *threads);
+    doneMutex(&b->lock);
+}
+
+void
+xmlParseBatch(const char **texts, const size_t *lens, size_t n,
+	XmlDoc **out, int nthreads)
+{
+    struct parseBatch b;
+
+    b.texts = texts;
+    b.lens = lens;
+    b.n = n;
+    b.next = 0;
+    b.out = out;
+    b.callback = 0;
+    b.ctx = 0;
+    parseBatch(&b, nthreads);
+}
+
+void
+xmlParseBatchNotify(const char **texts, const size_t *lens, size_t n,
+	int nthreads, XmlBatchCallback callback, void *ctx)
+{
+    struct parseBatch b;
+
+    b.texts = texts;
+    b.lens = lens;
+    b.n = n;
+    b.next = 0;
+    b.out = 0;
+    b.callback = callback;
+    b.ctx = ctx;
+    parseBatch(&b, nthreads);
+}
+
+XmlError
+xmlDocError(const XmlDoc *doc)
+{
+    return doc->err;
+}
+
+const char *
+xmlDocErrInfo(const XmlDoc *doc)
+{
+    if (doc->err == XML_UNMATCHEDCLOSE || doc->err == XML_CLOSEWOOPEN)
+    {
+	return doc->errInfo.s;
+    }
+    return 0;
+}
+
+char
+xmlDocErrChar(const XmlDoc *doc)
+{
+    if (doc->err == XML_UNEXPECTED) return doc->errInfo.c;
+    return 0;
+}
+
+long
+xmlDocLine(const XmlDoc *doc)
+{
+    return doc->line;
+}
+
+long
+xmlDocColumn(const XmlDoc *doc)
+{
+    return doc->col;
+}
+
+XmlElement *
 rootElement(const XmlDoc *doc)
 {
-    return doc->root;
+    /* a lazily parsed document can find an error after parsing */
+    return doc->err == XML_SUCCESS ? doc->root : 0;
+}
+
+XmlError
+xmlValidateAll(XmlDoc *doc)
+{
+    const XmlElement *e = doc->root;
+
+    /* elements not built yet have no children, so this walk only visits
+     * built elements */
+    const XmlElement *child;
+
+    while (e && doc->err == XML_SUCCESS)
+    {
+	if (e->lazy)
+	{
+	    parseContent((XmlElement *)e,
+		    (const struct lazyContent *)(void *)e->value,
+		    &noEvents, 0);
+	}
+	if ((child = childOf(e)))
+	{
+	    e = child;
+	    continue;
+	}
+	while (e != doc->root && !e->next) e = parentOf(e);
+	e = e == doc->root ? 0 : e + e->next;
+    }
+    return doc->err;
+}
+
+int
+xmlDocStats(const XmlDoc *doc, XmlStats *stats)
+{
+    if (!doc->stats) return -1;
+    updateStats(doc);
+    *stats = *doc->stats->out;
+    return 0;
+}
+
+void
+xmlDocPerror(const XmlDoc *doc, FILE *file, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!file) file = stderr;
+    if (fmt)
+    {
+	va_start(ap, fmt);
+	vfprintf(file, fmt, ap);
+	va_end(ap);
+    }
+    switch (doc->err)
+    {
+	case XML_SUCCESS:
+	    fputs(": successfully parsed.\n", file);
+	    break;
+
+	case XML_EOF:
+	    fputs(": unexpected end of file while parsing.\n", file);
+	    break;
+
+	case XML_SECONDROOT:
+	    fprintf(file, ": second root element found "
+		    "at line %ld, column %ld.\n", doc->line, doc->col);
+	    break;
+
+	case XML_UNNAMEDTAG:
+	    fprintf(file, ": tag without name found "
+		    "at line %ld, column %ld.\n", doc->line, doc->col);
+	    break;
+
+	case XML_UNNAMEDATTR:
+	    fprintf(file, ": attribute without name found "
+		    "at line %ld, column %ld.\n", doc->line, doc->col);
+	    break;
+
+	case XML_UNMATCHEDCLOSE:
+	    fprintf(file, ": closing tag doesn't match <%s> at line %ld, "
+		    "column %ld\n", doc->errInfo.s, doc->line, doc->col);
+	    break;
+
+	case XML_CLOSEWOOPEN:
+	    fprintf(file, ": closing tag </%s> was never opened at line %ld, "
+		    "column %ld\n", doc->errInfo.s, doc->line, doc->col);
+	    break;
+
+	case XML_UNEXPECTED:
+	    fprintf(file, ": found unexpected character `%c' at line %ld, "
+		    "column %ld\n", doc->errInfo.c, doc->line, doc->col);
+	    break;
+
+	case XML_NOMEM:
+	    fputs(": out of memory.\n", file);
+	    break;
+
+	default:
+	    fputs(": unknown error (aka BUG).\n", file);
+    }
+}
+
+XmlElement *
+firstChild(const XmlElement *element)
+{
+    MATERIALIZE(element);
+    return childOf(element);
+}
+
+XmlElement *
+lastChild(const XmlElement *element)
+{
+    MATERIALIZE(element);
+    return lastChildOf(element);
+}
+
+XmlElement *
+nextSibling(const XmlElement *element)
+{
+    return nextOf(element);
+}
+
+XmlElement *
+parentElement(const XmlElement *element)
+{
+    return parentOf(element);
+}
+
+/* an empty value is stored as 0 */
+static int
+hasValue(const XmlAttribute *att, const char *value)
+{
+    return !value || !strcmp(value, att->value ? att->value : "");
+}
+
+static int
+isMatching(const XmlElement *e,
+	const char *tagname, const char *attname, const char *attval)
+{
+    const struct attTable *t = attTableOf(e);
+    const XmlAttribute *att, *end;
+
+    if (tagname && strcmp(tagname, e->name)) return 0;
+    if (attname && t && !t->dups)
+    {
+	att = attTableFind(e, attname, strlen(attname));
+	return att && hasValue(att, attval);
+    }
+    if (!attname || !e->natts) return 1;
+    for (att = e->attributes, end = att + e->natts; att != end; ++att)
+    {
+	if (!strcmp(attname, att->name) && hasValue(att, attval)) return 1;
+    }
+    return 0;
+}
+
+XmlElement *
+findMatching(const XmlElement *element,
+	const char *tagname, const char *attname, const char *attval)
+{
+    const XmlElement *e = element;
+
+    do
+    {
+	if (isMatching(e, tagname, attname, attval)) return (XmlElement *)e;
+    } while ((e = nextElement(e, element)));
+
+    return 0;
+}
+
+XmlMatchIter
+xmlMatchBegin(const XmlElement *element,
+	const char *tagname, const char *attname, const char *attval)
+{
+    XmlMatchIter it;
+
+    it.top = element;
+    it.next = element;
+    it.tagname = tagname;
+    it.attname = attname;
+    it.attval = attval;
+    return it;
+}
+
+XmlElement *
+xmlMatchNext(XmlMatchIter *it)
+{
+    const XmlElement *e;
+
+    /* parent and sibling links are all the state a depth-first walk
+     * needs, so the iterator only remembers where to continue */
+    while ((e = it->next))
+    {
+	it->next = nextElement(e, it->top);
+	if (isMatching(e, it->tagname, it->attname, it->attval))
+	{
+	    return (XmlElement *)e;
+	}
+    }
+    return 0;
+}
+
+size_t
+xmlMatchNextN(XmlMatchIter *it, XmlElement **results, size_t max)
+{
+    size_t n = 0;
+
+    while (n < max && (results[n] = xmlMatchNext(it))) ++n;
+    return n;
+}
+
+XmlElement *
+findMatchingInterned(const XmlElement *element,
+	const char *tagname, const char *attname, const char *attval)
+{
+    const XmlElement *e = element;
+    const struct attTable *t;
+    const XmlAttribute *att, *end;
+
+    do
+    {
+	if (!tagname || tagname == e->name)
+	{
+	    if (attname && (t = attTableOf(e)) && !t->dups)
+	    {
+		att = attTableFind(e, attname, strlen(attname));
+		if (att && hasValue(att, attval))
+		{
+		    return (XmlElement *)e;
+		}
+		continue;
+	    }
+	    if (!attname || !e->natts) return (XmlElement *)e;
+	    for (att = e->attributes, end = att + e->natts; att != end; ++att)
+	    {
+		if (attname == att->name && hasValue(att, attval))
+		{
+		    return (XmlElement *)e;
+		}
+	    }
+	}
+    } while ((e = nextElement(e, element)));
+
+    return 0;
+}
+
+/* indexes built by xmlBuildIndex(), mapping a tag name or an attribute name
+ * and value to all matching elements in document order */
+struct indexEntry
+{
+    const char *name;
+    const char *value;
+    unsigned long hash;
+    size_t count;
+    const XmlElement *last;
+    XmlElement **elements;
+};
+
+static unsigned long
+hashKey(const char *name, const char *value)
+{
+    unsigned long hash = hashPointer(name);
+
+    if (value) hash ^= hashName(value, strlen(value));
+    return hash & 0xffffffffUL;
+}
+
+static size_t *
+findSlot(const struct xmlIndex *idx, const char *name, const char *value,
+	unsigned long hash)
+{
+    const struct indexEntry *k;
+    size_t *slot;
+    size_t i;
+
+    for (i = hash & (idx->size - 1); *(slot = idx->slots + i);
+	    i = (i + 1) & (idx->size - 1))
+    {
+	k = idx->keys + *slot - 1;
+	if (k->hash == hash && k->name == name
+		&& (!value || !strcmp(k->value, value)))
+	{
+	    break;
+	}
+    }
+    return slot;
+}
+
+/* an index is collected in scratch memory first, remembering each element
+ * found for a key, and copied to the arena in its final size */
+struct indexBuilder
+{
+    const XmlAllocator *allocator;
+    struct xmlIndex idx;
+    size_t keysSize;
+    struct
+    {
+	size_t key;
+	XmlElement *element;
+    } *found;
+    size_t foundCount;
+    size_t foundSize;
+};
+
+/* returns -1 if memory ran out */
+static int
+addKey(struct indexBuilder *b, XmlElement *element,
+	const char *name, const char *value)
+{
+    struct xmlIndex *idx = &b->idx;
+    unsigned long hash = hashKey(name, value);
+    struct indexEntry *k;
+    size_t *slot;
+    size_t size;
+    void *grown;
+    size_t i;
+
+    if (idx->count * 2 >= idx->size)
+    {
+	size = idx->size ? idx->size * 2 : 64;
+	if (!(grown = allocMem(b->allocator, size * sizeof *idx->slots)))
+	{
+	    return -1;
+	}
+	releaseMem(b->allocator, idx->slots, idx->size * sizeof *idx->slots);
+	idx->slots = grown;
+	idx->size = size;
+	memset(idx->slots, 0, idx->size * sizeof *idx->slots);
+	for (i = 0; i < idx->count; ++i)
+	{
+	    k = idx->keys + i;
+	    *findSlot(idx, k->name, k->value, k->hash) = i + 1;
+	}
+    }
+    slot = findSlot(idx, name, value, hash);
+    if (!*slot)
+    {
+	if (idx->count == b->keysSize)
+	{
+	    size = b->keysSize ? b->keysSize * 2 : 64;
+	    if (!(grown = resizeMem(b->allocator, idx->keys,
+			    b->keysSize * sizeof *idx->keys,
+			    size * sizeof *idx->keys)))
+	    {
+		return -1;
+	    }
+	    idx->keys = grown;
+	    b->keysSize = size;
+	}
+	k = idx->keys + idx->count++;
+	k->name = name;
+	k->value = value;
+	k->hash = hash;
+	k->count = 0;
+	k->last = 0;
+	*slot = idx->count;
+    }
+    k = idx->keys + *slot - 1;
+
+    /* an element with a duplicate attribute is listed once */
+    if (k->last == element) return 0;
+    if (b->foundCount == b->foundSize)
+    {
+	size = b->foundSize ? b->foundSize * 2 : 256;
+	if (!(grown = resizeMem(b->allocator, b->found,
+			b->foundSize * sizeof *b->found,
+			size * sizeof *b->found)))
+	{
+	    return -1;
+	}
+	b->found = grown;
+	b->foundSize = size;
+    }
+    k->last = element;
+    ++k->count;
+    b->found[b->foundCount].key = *slot - 1;
+    b->found[b->foundCount++].element = element;
+    return 0;
+}
+
+static void
+releaseIndexBuilder(struct indexBuilder *b)
+{
+    releaseMem(b->allocator, b->idx.keys, b->keysSize * sizeof *b->idx.keys);
+    releaseMem(b->allocator, b->idx.slots,
+	    b->idx.size * sizeof *b->idx.slots);
+    releaseMem(b->allocator, b->found, b->foundSize * sizeof *b->found);
+}
+
+/* copies the index into the document arena, returns -1 if memory ran
+ * out. The builder is released either way. */
+static int
+finishIndex(XmlDoc *doc, struct indexBuilder *b, struct xmlIndex *out)
+{
+    struct xmlIndex idx = b->idx;
+    XmlElement **lists;
+    struct indexEntry *k;
+    size_t i;
+
+    memset(out, 0, sizeof *out);
+    if (!idx.size) return 0;
+
+    idx.keys = arenaAlloc(&doc->arena, idx.count * sizeof *idx.keys);
+    idx.slots = arenaAlloc(&doc->arena, idx.size * sizeof *idx.slots);
+
+    /* every key gets its slice of one array of element pointers, filled
+     * in document order */
+    lists = arenaAlloc(&doc->arena, b->foundCount * sizeof *lists);
+    if (!idx.keys || !idx.slots || !lists)
+    {
+	releaseIndexBuilder(b);
+	return -1;
+    }
+    memcpy(idx.keys, b->idx.keys, idx.count * sizeof *idx.keys);
+    memcpy(idx.slots, b->idx.slots, idx.size * sizeof *idx.slots);
+    for (i = 0; i < idx.count; ++i)
+    {
+	idx.keys[i].elements = lists;
+	lists += idx.keys[i].count;
+	idx.keys[i].count = 0;
+    }
+    for (i = 0; i < b->foundCount; ++i)
+    {
+	k = idx.keys + b->found[i].key;
+	k->elements[k->count++] = b->found[i].element;
+    }
+
+    releaseIndexBuilder(b);
+    *out = idx;
+    return 0;
+}
+
+int
+xmlBuildIndex(XmlDoc *doc, int flags)
+{
+    struct indexBuilder tags;
+    struct indexBuilder atts;
+    struct xmlIndex tagIndex;
+    struct xmlIndex attIndex;
+    XmlElement *e;
+    const XmlAttribute *a, *end;
+    int ok = 1;
+
+    if (!doc->root) return -1;
+
+    memset(&tags, 0, sizeof tags);
+    memset(&atts, 0, sizeof atts);
+    tags.allocator = atts.allocator = docAllocator(doc);
+    e = doc->root;
+    do
+    {
+	if ((flags & XML_INDEX_TAGS) && addKey(&tags, e, e->name, 0) < 0)
+	{
+	    ok = 0;
+	}
+	if (ok && (flags & XML_INDEX_ATTRIBUTES))
+	{
+	    for (a = e->attributes, end = a + e->natts; ok && a != end; ++a)
+	    {
+		ok = addKey(&atts, e, a->name, a->value ? a->value : "") == 0;
+	    }
+	}
+    } while (ok && (e = (XmlElement *)nextElement(e, doc->root)));
+
+    /* a lazily parsed element may have run out of memory when built */
+    if (doc->err == XML_NOMEM) ok = 0;
+    if (!ok)
+    {
+	releaseIndexBuilder(&tags);
+	releaseIndexBuilder(&atts);
+	return -1;
+    }
+    ok = finishIndex(doc, &tags, &tagIndex) == 0;
+    if (finishIndex(doc, &atts, &attIndex) < 0 || !ok) return -1;
+    doc->tagIndex = tagIndex;
+    doc->attIndex = attIndex;
+    return 0;
+}
+
+/* interned copy of name if it's in the document, without adding it */
+static const char *
+lookupName(const XmlDoc *doc, const char *name)
+{
+    const XmlNameTable *t = doc->names;
+    size_t len = strlen(name);
+
+    if (!t->size) return 0;
+    return findName(t, name, len, hashName(name, len))->name;
+}
+
+static int
+hasAttribute(const XmlElement *e, const char *att, const char *attval)
+{
+    const struct attTable *t = attTableOf(e);
+    const XmlAttribute *a, *end;
+
+    if (t && !t->dups)
+    {
+	a = attTableFind(e, att, strlen(att));
+	return a && (!attval || !strcmp(attval, a->value ? a->value : ""));
+    }
+    for (a = e->attributes, end = a + e->natts; a != end; ++a)
+    {
+	if (a->name == att
+		&& (!attval || !strcmp(attval, a->value ? a->value : "")))
+	{
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+size_t
+xmlIndexLookup(const XmlDoc *doc, const char *tagname, const char *attname,
+	const char *attval, XmlElement **results, size_t max)
+{
+    const struct indexEntry *entry = 0;
+    const XmlElement *e;
+    const char *tag = 0;
+    const char *att = 0;
+    size_t count = 0;
+    size_t slot;
+    size_t i = 0;
+
+    if (!doc->root) return 0;
+    if (tagname && !(tag = lookupName(doc, tagname))) return 0;
+    if (attname && !(att = lookupName(doc, attname))) return 0;
+
+    if (att && attval && doc->attIndex.size)
+    {
+	slot = *findSlot(&doc->attIndex, att, attval, hashKey(att, attval));
+	if (!slot) return 0;
+	entry = doc->attIndex.keys + slot - 1;
+    }
+    else if (tag && doc->tagIndex.size)
+    {
+	slot = *findSlot(&doc->tagIndex, tag, 0, hashKey(tag, 0));
+	if (!slot) return 0;
+	entry = doc->tagIndex.keys + slot - 1;
+    }
+
+    /* without a usable index, check every element */
+    e = entry ? entry->elements[0] : doc->root;
+
+    while (e)
+    {
+	if ((!tag || e->name == tag) && (!att || hasAttribute(e, att, attval)))
+	{
+	    if (count < max) results[count] = (XmlElement *)e;
+	    ++count;
+	}
+	if (entry) e = ++i < entry->count ? entry->elements[i] : 0;
+	else e = nextElement(e, doc->root);
+    }
+    return count;
+}
+
+XmlElement *
+xmlFindById(const XmlDoc *doc, const char *id)
+{
+    XmlElement *found;
+
+    if (xmlIndexLookup(doc, 0, "id", id, &found, 1)) return found;
+    return 0;
+}
+
+/* compiled path queries: a list of steps, each with a name test and
+ * predicates. Evaluation walks the tree once in document order, keeping a
+ * bit set of the steps matched by each open element. */
+#define QUERY_MAXSTEPS 30
+
+struct queryPred
+{
+    const char *att;
+    const char *value;
+    unsigned long pos;
+    size_t counter;
+};
+
+struct queryStep
+{
+    const char *name;
+    int descendant;
+    size_t npreds;
+    struct queryPred *preds;
+};
+
+struct XmlQuery
+{
+    struct arena arena;
+    int absolute;
+    unsigned long descendants;
+    size_t nsteps;
+    size_t ncounters;
+    struct queryStep steps[QUERY_MAXSTEPS + 1];
+};
+
+static int
+isQueryNameChar(char c)
+{
+    return c && !isWs(c) && !strchr("/[]@='\"*", c);
+}
+
+/* returns 0 if there is no name or memory ran out, check
+ * isQueryNameChar() first to tell them apart */
+static const char *
+queryName(XmlQuery *q, const char **pos)
+{
+    const char *start = *pos;
+
+    while (isQueryNameChar(**pos)) ++(*pos);
+    if (*pos == start) return 0;
+    return arenaString(&q->arena, start, (size_t)(*pos - start));
+}
+
+/* returns -1 if the predicate isn't valid, -2 if memory ran out */
+static int
+queryPred(XmlQuery *q, struct queryPred *pred, const char **pos)
+{
+    const char *p = *pos;
+    const char *start;
+    char quote;
+
+    pred->att = 0;
+    pred->value = 0;
+    pred->pos = 0;
+    while (isWs(*p)) ++p;
+    if (*p == '@')
+    {
+	++p;
+	if (!isQueryNameChar(*p)) return -1;
+	if (!(pred->att = queryName(q, &p))) return -2;
+	while (isWs(*p)) ++p;
+	if (*p == '=')
+	{
+	    ++p;
+	    while (isWs(*p)) ++p;
+	    if (*p != '"' && *p != '\'') return -1;
+	    quote = *p++;
+	    start = p;
+	    while (*p && *p != quote) ++p;
+	    if (!*p) return -1;
+	    pred->value = arenaString(&q->arena, start, (size_t)(p - start));
+	    if (!pred->value) return -2;
+	    ++p;
+	}
+    }
+    else if (*p >= '1' && *p <= '9')
+    {
+	while (*p >= '0' && *p <= '9') pred->pos = pred->pos * 10
+	    + (unsigned long)(*p++ - '0');
+	pred->counter = q->ncounters++;
+    }
+    else return -1;
+    while (isWs(*p)) ++p;
+    if (*p != ']') return -1;
+    *pos = p + 1;
+    return 0;
+}
+
+XmlQuery *
+xmlCompileQuery(const char *path)
+{
+    struct arena arena;
+    XmlQuery *q;
+    struct queryStep *step;
+    struct queryPred preds[16];
+    const char *p = path;
+    int rc;
+
+    arenaInit(&arena, 0);
+    if (!(q = arenaAlloc(&arena, sizeof(XmlQuery))))
+    {
+	errno = ENOMEM;
+	return 0;
+    }
+    q->arena = arena;
+    q->absolute = *p == '/';
+    q->descendants = 0;
+    q->nsteps = 0;
+    q->ncounters = 0;
+    if (*p == '/' && p[1] != '/') ++p;
+    while (1)
+    {
+	if (q->nsteps == QUERY_MAXSTEPS) goto fail;
+	step = q->steps + ++q->nsteps;
+	step->descendant = 0;
+	if (*p == '/' && p[1] == '/')
+	{
+	    /* children of elements matching the previous step or their
+	     * descendants can match */
+	    step->descendant = 1;
+	    q->descendants |= 1UL << (q->nsteps - 1);
+	    p += 2;
+	}
+	if (*p == '*')
+	{
+	    step->name = 0;
+	    ++p;
+	}
+	else if (!isQueryNameChar(*p)) goto fail;
+	else if (!(step->name = queryName(q, &p))) goto nomem;
+	step->npreds = 0;
+	while (*p == '[')
+	{
+	    if (step->npreds == sizeof preds / sizeof *preds) goto fail;
+	    ++p;
+	    if ((rc = queryPred(q, preds + step->npreds++, &p)) == -2)
+	    {
+		goto nomem;
+	    }
+	    if (rc < 0) goto fail;
+	}
+	step->preds = 0;
+	if (step->npreds)
+	{
+	    step->preds = arenaAlloc(&q->arena, step->npreds * sizeof *preds);
+	    if (!step->preds) goto nomem;
+	    memcpy(step->preds, preds, step->npreds * sizeof *preds);
+	}
+	if (!*p) break;
+	if (*p != '/') goto fail;
+	if (p[1] != '/') ++p;
+    }
+    return q;
+
+fail:
+    arenaFree(&q->arena);
+    errno = EINVAL;
+    return 0;
+
+nomem:
+    arenaFree(&q->arena);
+    errno = ENOMEM;
+    return 0;
+}
+
+void
+xmlFreeQuery(XmlQuery *query)
+{
+    /* the query lives in its first arena chunk */
+    if (query) arenaFree(&query->arena);
+}
+
+/* state of an open element while running a query: the steps it matched
+ * and the steps matched by it or any ancestor */
+struct queryFrame
+{
+    unsigned long matched;
+    unsigned long below;
+};
+
+static int
+hasAttValue(const XmlElement *e, const char *att, const char *value)
+{
+    const struct attTable *t = attTableOf(e);
+    const XmlAttribute *a, *end;
+
+    if (t && !t->dups)
+    {
+	a = attTableFind(e, att, strlen(att));
+	return a && (!value || !strcmp(value, a->value ? a->value : ""));
+    }
+    for (a = e->attributes, end = a + e->natts; a != end; ++a)
+    {
+	if (a->name == att || !strcmp(a->name, att))
+	{
+	    if (!value || !strcmp(value, a->value ? a->value : "")) return 1;
+	}
+    }
+    return 0;
+}
+
+/* steps matched by e, a child of the element with frame parent */
+static unsigned long
+matchSteps(const XmlQuery *q, const XmlElement *e,
+	const struct queryFrame *parent, unsigned long *counters)
+{
+    const struct queryStep *step;
+    const struct queryPred *pred;
+    unsigned long matched = 0;
+    size_t i;
+    size_t j;
+
+    for (i = 1; i <= q->nsteps; ++i)
+    {
+	step = q->steps + i;
+	if (!((step->descendant ? parent->below : parent->matched)
+		    & 1UL << (i - 1)))
+	{
+	    continue;
+	}
+	if (step->name && step->name != e->name && strcmp(step->name, e->name))
+	{
+	    continue;
+	}
+	for (j = 0; j < step->npreds; ++j)
+	{
+	    pred = step->preds + j;
+	    if (pred->att)
+	    {
+		if (!hasAttValue(e, pred->att, pred->value)) break;
+	    }
+	    else if (++counters[pred->counter] != pred->pos) break;
+	}
+	if (j == step->npreds) matched |= 1UL << i;
+    }
+    return matched;
+}
+
+size_t
+xmlQueryRun(const XmlQuery *query, const XmlElement *context,
+	int (*callback)(void *ctx, XmlElement *element), void *ctx)
+{
+    struct queryFrame *frames;
+    unsigned long *counters;
+    unsigned long final = 1UL << query->nsteps;
+    unsigned long matched;
+    size_t framesSize = 32;
+    size_t nc = query->ncounters;
+    size_t count = 0;
+    size_t d = 0;
+    size_t i;
+    const XmlElement *e = context;
+    const XmlElement *child;
+    void *grown;
+
+    frames = allocMem(&globalAllocator, framesSize * sizeof *frames);
+    counters = allocMem(&globalAllocator,
+	    framesSize * (nc ? nc : 1) * sizeof *counters);
+    if (!frames || !counters)
+    {
+	count = (size_t)-1;
+	goto done;
+    }
+    memset(counters, 0, framesSize * (nc ? nc : 1) * sizeof *counters);
+
+    /* frame 0 is the element the path starts from, matching step 0: the
+     * (virtual) document node for an absolute path, so the root element is
+     * its only child */
+    frames[0].matched = frames[0].below = 1;
+    if (query->absolute) while (e->parent) e = parentOf(e);
+    else
+    {
+	MATERIALIZE(e);
+	e = childOf(e);
+    }
+
+    while (e)
+    {
+	if (d + 1 == framesSize)
+	{
+	    if (!(grown = resizeMem(&globalAllocator, frames,
+			    framesSize * sizeof *frames,
+			    2 * framesSize * sizeof *frames)))
+	    {
+		count = (size_t)-1;
+		break;
+	    }
+	    frames = grown;
+	    if (!(grown = resizeMem(&globalAllocator, counters,
+			    framesSize * (nc ? nc : 1) * sizeof *counters,
+			    2 * framesSize * (nc ? nc : 1) * sizeof *counters)))
+	    {
+		/* frames already has the new size */
+		releaseMem(&globalAllocator, frames,
+			2 * framesSize * sizeof *frames);
+		frames = 0;
+		count = (size_t)-1;
+		break;
+	    }
+	    counters = grown;
+	    framesSize *= 2;
+	}
+	matched = matchSteps(query, e, frames + d, counters + d * nc);
+	frames[d + 1].matched = matched;
+	frames[d + 1].below = frames[d].below | matched;
+	if (matched & final)
+	{
+	    ++count;
+	    if (callback && callback(ctx, (XmlElement *)e)) break;
+	}
+
+	/* only descend if a child can match some step */
+	MATERIALIZE(e);
+	if ((child = childOf(e)) && ((matched & (final - 1))
+		    || (frames[d + 1].below & query->descendants)))
+	{
+	    ++d;
+	    for (i = 0; i < nc; ++i) counters[d * nc + i] = 0;
+	    e = child;
+	    continue;
+	}
+
+	/* move on to the next sibling of e or of its nearest ancestor */
+	while (!e->next)
+	{
+	    if (!d--)
+	    {
+		e = 0;
+		break;
+	    }
+	    e = parentOf(e);
+	}
+	if (e) e = e + e->next;
+    }
+
+done:
+    releaseMem(&globalAllocator, frames, framesSize * sizeof *frames);
+    releaseMem(&globalAllocator, counters,
+	    framesSize * (nc ? nc : 1) * sizeof *counters);
+    return count;
+}
+
+/* projection parsing (XmlParseOptions.keep): the keep paths are compiled
+ * as queries and matched against the names of open elements while
+ * tokenizing, using the same bit sets as xmlQueryRun(). An element that
+ * can't lead to a match has its content skipped by the tokenizer, one that
+ * might is only built when a match is found below it. */
+enum projState
+{
+    PS_BUILT,		/* built as an ancestor of a kept element */
+    PS_PENDING,		/* not built, some descendant might be kept */
+    PS_KEPT,		/* built with all its descendants */
+    PS_SKIPPED		/* not built, nothing below is kept */
+};
+
+struct projLevel
+{
+    enum projState state;
+    const char *name;
+    size_t nameLen;
+    size_t atts;
+};
+
+/* attribute of a pending element, all pointing into the parsed text */
+struct pendingAtt
+{
+    const char *name;
+    size_t nameLen;
+    const char *value;
+    size_t valueLen;
+};
+
+struct projection
+{
+    XmlDoc *doc;
+    const XmlAllocator *allocator;
+    struct tokenizer *t;
+    XmlQuery **queries;
+    size_t nqueries;
+
+    /* level 0 stands for the document, frames holds nqueries frames for
+     * every level */
+    struct projLevel *levels;
+    struct queryFrame *frames;
+    size_t depth;
+    size_t size;
+    struct pendingAtt *atts;
+    size_t natts;
+    size_t attsSize;
+};
+
+/* steps of q matched by an element named name, child of the element with
+ * frame parent */
+static unsigned long
+projectSteps(const XmlQuery *q, const char *name, size_t len,
+	const struct queryFrame *parent)
+{
+    const struct queryStep *step;
+    unsigned long matched = 0;
+    size_t i;
+
+    for (i = 1; i <= q->nsteps; ++i)
+    {
+	step = q->steps + i;
+	if (!((step->descendant ? parent->below : parent->matched)
+		    & 1UL << (i - 1)))
+	{
+	    continue;
+	}
+	if (step->name && (strncmp(step->name, name, len) || step->name[len]))
+	{
+	    continue;
+	}
+	matched |= 1UL << i;
+    }
+    return matched;
+}
+
+/* build the pending ancestors of a kept element */
+static void
+buildPending(struct projection *p)
+{
+    struct projLevel *level;
+    const struct pendingAtt *a;
+    size_t i;
+
+    for (i = 1; i < p->depth && p->doc->err == XML_SUCCESS; ++i)
+    {
+	level = p->levels + i;
+	if (level->state != PS_PENDING) continue;
+	buildStart(p->doc, level->name, level->nameLen);
+	for (a = p->atts + level->atts; a != p->atts + level[1].atts; ++a)
+	{
+	    buildAttribute(p->doc, a->name, a->nameLen, a->value, a->valueLen);
+	}
+	level->state = PS_BUILT;
+    }
+}
+
+static void
+projStart(void *ctx, const char *name, size_t nameLen)
+{
+    struct projection *p = ctx;
+    struct projLevel *level;
+    const struct queryFrame *pf;
+    struct queryFrame *f;
+    enum projState state = PS_SKIPPED;
+    unsigned long final;
+    void *levels;
+    void *frames;
+    size_t i;
+
+    if (p->depth + 1 == p->size)
+    {
+	levels = allocMem(p->allocator, 2 * p->size * sizeof *p->levels);
+	frames = allocMem(p->allocator, 2 * p->size
+		* (p->nqueries ? p->nqueries : 1) * sizeof *p->frames);
+	if (!levels || !frames)
+	{
+	    releaseMem(p->allocator, levels, 2 * p->size * sizeof *p->levels);
+	    releaseMem(p->allocator, frames, 2 * p->size
+		    * (p->nqueries ? p->nqueries : 1) * sizeof *p->frames);
+	    noMem(p->doc);
+	    return;
+	}
+	memcpy(levels, p->levels, p->size * sizeof *p->levels);
+	memcpy(frames, p->frames,
+		p->size * (p->nqueries ? p->nqueries : 1) * sizeof *p->frames);
+	releaseMem(p->allocator, p->levels, p->size * sizeof *p->levels);
+	releaseMem(p->allocator, p->frames,
+		p->size * (p->nqueries ? p->nqueries : 1) * sizeof *p->frames);
+	p->levels = levels;
+	p->frames = frames;
+	p->size *= 2;
+    }
+    ++p->depth;
+    level = p->levels + p->depth;
+    level->name = name;
+    level->nameLen = nameLen;
+    level->atts = p->natts;
+
+    /* below a skipped element only if skipping failed, the rest of the
+     * document is unbalanced then and skipping again would only fail again */
+    if (level[-1].state == PS_KEPT || level[-1].state == PS_SKIPPED)
+    {
+	state = level[-1].state;
+    }
+    else
+    {
+	f = p->frames + p->depth * p->nqueries;
+	pf = f - p->nqueries;
+	for (i = 0; i < p->nqueries; ++i)
+	{
+	    f[i].matched = projectSteps(p->queries[i], name, nameLen, pf + i);
+	    f[i].below = pf[i].below | f[i].matched;
+	    final = 1UL << p->queries[i]->nsteps;
+	    if (f[i].matched & final) state = PS_KEPT;
+	    else if (state == PS_SKIPPED && ((f[i].matched & (final - 1))
+			|| (f[i].below & p->queries[i]->descendants)))
+	    {
+		state = PS_PENDING;
+	    }
+	}
+	if (p->depth == 1 && state != PS_KEPT) state = PS_BUILT;
+	if (state == PS_SKIPPED) p->t->skip = 1;
+    }
+    level->state = state;
+
+    if (state == PS_KEPT) buildPending(p);
+    if ((state == PS_KEPT || state == PS_BUILT)
+	    && p->doc->err == XML_SUCCESS)
+    {
+	buildStart(p->doc, name, nameLen);
+    }
+}
+
+static void
+projAttribute(void *ctx, const char *name, size_t nameLen,
+	const char *value, size_t valueLen)
+{
+    struct projection *p = ctx;
+    struct pendingAtt *a;
+    void *atts;
+
+    switch (p->levels[p->depth].state)
+    {
+	case PS_BUILT:
+	case PS_KEPT:
+	    buildAttribute(p->doc, name, nameLen, value, valueLen);
+	    break;
+
+	case PS_PENDING:
+	    if (p->natts == p->attsSize)
+	    {
+		if (!(atts = resizeMem(p->allocator, p->atts,
+				p->attsSize * sizeof *p->atts,
+				(p->attsSize ? p->attsSize * 2 : 16)
+				* sizeof *p->atts)))
+		{
+		    noMem(p->doc);
+		    break;
+		}
+		p->atts = atts;
+		p->attsSize = p->attsSize ? p->attsSize * 2 : 16;
+	    }
+	    a = p->atts + p->natts++;
+	    a->name = name;
+	    a->nameLen = nameLen;
+	    a->value = value;
+	    a->valueLen = valueLen;
+	    break;
+
+	default:
+	    break;
+    }
+}
+
+static void
+projText(void *ctx, const char *text, size_t len)
+{
+    struct projection *p = ctx;
+
+    if (p->levels[p->depth].state == PS_KEPT) buildText(p->doc, text, len);
+}
+
+static void
+projEnd(void *ctx, const char *name, size_t nameLen)
+{
+    struct projection *p = ctx;
+    struct projLevel *level = p->levels + p->depth--;
+
+    if (level->state == PS_KEPT || level->state == PS_BUILT)
+    {
+	buildEnd(p->doc, name, nameLen);
+    }
+    p->natts = level->atts;
+}
+
+static const XmlHandler projector = {
+    projStart,
+    projAttribute,
+    projText,
+    projEnd
+};
+
+/* keep paths are absolute and only test names */
+static int
+isKeepPath(const XmlQuery *q)
+{
+    size_t i;
+
+    if (!q || !q->absolute) return 0;
+    for (i = 1; i <= q->nsteps; ++i) if (q->steps[i].npreds) return 0;
+    return 1;
+}
+
+static XmlDoc *
+parseProjected(const char *xmlText, size_t len,
+	const XmlParseOptions *options)
+{
+    struct projection p;
+    XmlParseOptions eager;
+    XmlDoc *doc = 0;
+    struct tokenizer t;
+    size_t i;
+
+    p.allocator = options->allocator ? options->allocator : &globalAllocator;
+    for (p.nqueries = 0; options->keep[p.nqueries]; ++p.nqueries);
+    p.queries = allocMem(p.allocator,
+	    (p.nqueries ? p.nqueries : 1) * sizeof *p.queries);
+    if (!p.queries)
+    {
+	errno = ENOMEM;
+	return 0;
+    }
+    for (i = 0; i < p.nqueries; ++i)
+    {
+	if (!isKeepPath(p.queries[i] = xmlCompileQuery(options->keep[i])))
+	{
+	    /* a failed compile has set errno already */
+	    if (p.queries[i])
+	    {
+		++i;
+		errno = EINVAL;
+	    }
+	    goto done;
+	}
+    }
+    if (!(doc = newDoc(xmlText, len, p.allocator))) goto done;
+    if (options->names) doc->names = options->names;
+    if (options->stats) initStats(doc, options->stats, options->timing);
+    p.doc = doc;
+    p.t = &t;
+    p.size = 16;
+    p.levels = allocMem(p.allocator, p.size * sizeof *p.levels);
+    p.frames = allocMem(p.allocator, p.size * (p.nqueries ? p.nqueries : 1)
+	    * sizeof *p.frames);
+    if (!p.levels || !p.frames)
+    {
+	releaseMem(p.allocator, p.levels, p.size * sizeof *p.levels);
+	releaseMem(p.allocator, p.frames, p.size
+		* (p.nqueries ? p.nqueries : 1) * sizeof *p.frames);
+	noMem(doc);
+	goto done;
+    }
+    p.depth = 0;
+    p.levels[0].state = PS_BUILT;
+    for (i = 0; i < p.nqueries; ++i) p.frames[i].matched
+	= p.frames[i].below = 1;
+    p.atts = 0;
+    p.natts = 0;
+    p.attsSize = 0;
+    initTokenizer(&t, doc, &projector, &p);
+    scan(&t, xmlText);
+    doneTokenizer(&t);
+    releaseMem(p.allocator, p.levels, p.size * sizeof *p.levels);
+    releaseMem(p.allocator, p.frames, p.size * (p.nqueries ? p.nqueries : 1)
+	    * sizeof *p.frames);
+    releaseMem(p.allocator, p.atts, p.attsSize * sizeof *p.atts);
+
+done:
+    while (i--) xmlFreeQuery(p.queries[i]);
+    releaseMem(p.allocator, p.queries,
+	    (p.nqueries ? p.nqueries : 1) * sizeof *p.queries);
+    if (doc && doc->err != XML_SUCCESS && doc->err != XML_NOMEM)
+    {
+	/* as for lazy parsing, skipped content may hide the first error */
+	freeDoc(doc);
+	eager = *options;
+	eager.keep = 0;
+	eager.lazy = 0;
+	doc = parse(xmlText, len, 0, &eager);
+    }
+    else if (doc) finishTree(doc);
+    return doc;
+}
+
+XmlAttribute *
+xmlGetAttribute(const XmlElement *element, const char *name)
+{
+    return xmlGetAttributeN(element, name, strlen(name));
+}
+
+XmlAttribute *
+xmlGetAttributeN(const XmlElement *element, const char *name, size_t len)
+{
+    XmlAttribute *a, *end;
+
+    if (attTableOf(element)) return attTableFind(element, name, len);
+    for (a = element->attributes, end = a + element->natts; a != end; ++a)
+    {
+	if (!strncmp(a->name, name, len) && !a->name[len]) return a;
+    }
+    return 0;
+}
+
+XmlAttribute *
+firstAttribute(const XmlElement *element)
+{
+    return element->attributes;
+}
+
+XmlAttribute *
+nextAttribute(const XmlAttribute *attribute)
+{
+    const XmlElement *e = attribute->parent;
+
+    return (attribute + 1 != e->attributes + e->natts ?
+	    (XmlAttribute *)attribute + 1 : 0);
+}
+
+XmlElement *
+attributeElement(const XmlAttribute *attribute)
+{
+    return attribute->parent;
+}
+
+const char *
+tagName(const XmlElement *element)
+{
+    return element->name;
+}
+
+const char *
+elementContent(const XmlElement *element)
+{
+    MATERIALIZE(element);
+    return contentOf(element);
+}
+
+const char *
+attributeName(const XmlAttribute *attribute)
+{
+    return attribute->name;
+}
+
+const char *
+attributeValue(const XmlAttribute *attribute)
+{
+    return attribute->value;
+}
+
+const char *
+xmlElementSource(const XmlElement *element, size_t *len)
+{
+    const struct elementSpan *span = elementBlock(element)->spans;
+
+    if (!span || !(span += element->index)->start) return 0;
+    *len = (size_t)(span->end - span->start);
+    return span->start;
+}
+
+const char *
+xmlAttributeSource(const XmlAttribute *attribute, size_t *len)
+{
+    const XmlElement *e = attribute->parent;
+    const struct nodeBlock *b = elementBlock(e);
+    const struct attSpan *span;
+
+    if (!b->attSpans) return 0;
+    span = b->attSpans + b->spans[e->index].firstAtt
+	+ (size_t)(attribute - e->attributes);
+    *len = (size_t)(span->end - span->start);
+    return span->start;
+}
+
+long
+xmlNodeLine(const XmlDoc *doc, const char *source, long *column)
+{
+    long line;
+    long col;
+
+    if (!doc->spans || !source || !doc->text
+	    || source < doc->text || source > doc->end) return 0;
+    position(doc, source, &line, &col);
+    if (column) *column = col;
+    return line;
+}
+
+/* output of xmlWrite() is collected in a buffer of this size, longer names
+ * and values are passed on without copying */
+#define WRITEBUF_SIZE 8192
+
+/* writes either through a fixed buffer to a sink, or (without sink) to a
+ * growing heap buffer holding the whole text for xmlText() */
+struct xmlWriter
+{
+    XmlSink *sink;
+    char *buf;
+    size_t used;
+    size_t size;
+    int err;
+};
+
+/* line break and indentation for up to 32 levels in one piece */
+static const char newlineIndent[] =
+    "\n                                                                ";
+
+#ifdef WIN32
+static int
+fdWrite(int fd, const char *data, size_t len)
+{
+    int n;
+
+    while (len)
+    {
+	n = _write(fd, data, len > 0x4000000 ? 0x4000000 : (unsigned)len);
+	if (n < 0) return -1;
+	data += n;
+	len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int
+fdWrite2(int fd, const char *a, size_t alen, const char *b, size_t blen)
+{
+    if (fdWrite(fd, a, alen) < 0) return -1;
+    return fdWrite(fd, b, blen);
+}
+#else
+/* write both pieces with a single system call if possible */
+static int
+fdWrite2(int fd, const char *a, size_t alen, const char *b, size_t blen)
+{
+    struct iovec iov[2];
+    ssize_t n;
+
+    while (alen + blen)
+    {
+	iov[0].iov_base = (char *)a;
+	iov[0].iov_len = alen;
+	iov[1].iov_base = (char *)b;
+	iov[1].iov_len = blen;
+	n = alen ? writev(fd, iov, 2) : writev(fd, iov + 1, 1);
+	if (n < 0)
+	{
+	    if (errno == EINTR) continue;
+	    return -1;
+	}
+
+	/* nothing written would repeat forever */
+	if (!n)
+	{
+	    errno = EIO;
+	    return -1;
+	}
+	if ((size_t)n < alen)
+	{
+	    a += n;
+	    alen -= (size_t)n;
+	}
+	else
+	{
+	    b += (size_t)n - alen;
+	    blen -= (size_t)n - alen;
+	    alen = 0;
+	}
+    }
+    return 0;
+}
+#endif
+
+static int
+fileSinkWrite(void *ctx, const char *data, size_t len)
+{
+    return fwrite(data, 1, len, (FILE *)ctx) == len ? 0 : -1;
+}
+
+void
+xmlFileSink(XmlSink *sink, FILE *file)
+{
+    sink->write = fileSinkWrite;
+    sink->ctx = file;
+    sink->fd = -1;
+}
+
+void
+xmlFdSink(XmlSink *sink, int fd)
+{
+    sink->write = 0;
+    sink->ctx = 0;
+    sink->fd = fd;
+}
+
+void
+xmlCallbackSink(XmlSink *sink,
+	int (*write)(void *ctx, const char *data, size_t len), void *ctx)
+{
+    sink->write = write;
+    sink->ctx = ctx;
+    sink->fd = -1;
+}
+
+/* pass on the buffer followed by len bytes of data */
+static void
+wFlush(struct xmlWriter *w, const char *data, size_t len)
+{
+    XmlSink *sink = w->sink;
+
+    if (w->err) return;
+
+    /* an fd sink has no callback, a bad fd fails like any write error */
+    if (!sink->write)
+    {
+	if (fdWrite2(sink->fd, w->buf, w->used, data, len) < 0) w->err = 1;
+    }
+    else if ((w->used && sink->write(sink->ctx, w->buf, w->used) != 0)
+	    || (len && sink->write(sink->ctx, data, len) != 0))
+    {
+	w->err = 1;
+    }
+    w->used = 0;
+}
+
+static void
+wGrow(struct xmlWriter *w, size_t len)
+{
+    size_t size = w->size * 2;
+    char *grown;
+
+    if (size < w->used + len) size = w->used + len;
+    if (!(grown = realloc(w->buf, size)))
+    {
+	w->err = 1;
+	w->used = 0;
+	return;
+    }
+    w->buf = grown;
+    w->size = size;
+}
+
+static void
+wAppend(struct xmlWriter *w, const char *data, size_t len)
+{
+    if (len > w->size - w->used)
+    {
+	if (!w->sink) wGrow(w, len);
+	else if (len >= w->size / 2)
+	{
+	    wFlush(w, data, len);
+	    return;
+	}
+	else wFlush(w, 0, 0);
+	if (w->err) return;
+    }
+    memcpy(w->buf + w->used, data, len);
+    w->used += len;
+}
+
+/* names and most values are short, copying them right away is faster
+ * than measuring them first */
+static void
+wString(struct xmlWriter *w, const char *s)
+{
+    char *p = w->buf + w->used;
+    size_t n = w->size - w->used;
+
+    if (n > 32) n = 32;
+    while (n--)
+    {
+	if (!(*p = *s)) break;
+	++p;
+	++s;
+    }
+    w->used = (size_t)(p - w->buf);
+    if (*s) wAppend(w, s, strlen(s));
 }
 
-void
-xmlDocPerror(const XmlDoc *doc, FILE *file, const char *fmt, ...)
+/* the markup between names and values is written through this macro, so
+ * the common case needs neither a call nor a variable length copy */
+#define wLiteral(w, s) do { \
+    if (sizeof(s) - 1 <= (w)->size - (w)->used) \
+    { \
+	memcpy((w)->buf + (w)->used, (s), sizeof(s) - 1); \
+	(w)->used += sizeof(s) - 1; \
+    } \
+    else wAppend((w), (s), sizeof(s) - 1); \
+} while (0)
+
+/* start a new line for element */
+static void
+wNewline(struct xmlWriter *w, const XmlElement *element)
 {
-    va_list ap;
+    size_t n = (size_t)element->depth * 2 + 1;
 
-    if (!file) file = stderr;
-    if (fmt)
+    if (n <= sizeof newlineIndent - 1)
     {
-	va_start(ap, fmt);
-	vfprintf(file, fmt, ap);
-	va_end(ap);
+	wAppend(w, newlineIndent, n);
+	return;
     }
-    switch (doc->err)
+    wAppend(w, newlineIndent, sizeof newlineIndent - 1);
+    for (n -= sizeof newlineIndent - 1; n > sizeof newlineIndent - 2;
+	    n -= sizeof newlineIndent - 2)
     {
-	case XML_SUCCESS:
-	    fputs(": successfully parsed.\n", file);
-	    break;
+	wAppend(w, newlineIndent + 1, sizeof newlineIndent - 2);
+    }
+    wAppend(w, newlineIndent + 1, n);
+}
 
-	case XML_EOF:
-	    fputs(": unexpected end of file while parsing.\n", file);
-	    break;
+static void
+wAttributes(struct xmlWriter *w, const XmlElement *element)
+{
+    const XmlAttribute *a, *end;
+    const char *value;
 
-	case XML_SECONDROOT:
-	    fprintf(file, ": second root element found "
-		    "at line %ld, column %ld.\n", doc->line, doc->col);
-	    break;
+    for (a = element->attributes, end = a + element->natts; a != end; ++a)
+    {
+	value = a->value ? a->value : "";
+	wLiteral(w, " ");
+	wString(w, a->name);
+	if (strchr(value, '"'))
+	{
+	    /* there's no escaping, a value containing both kinds of quotes
+	     * can't be written */
+	    if (strchr(value, '\'')) wLiteral(w, "=\"\"");
+	    else
+	    {
+		wLiteral(w, "='");
+		wString(w, value);
+		wLiteral(w, "'");
+	    }
+	}
+	else
+	{
+	    wLiteral(w, "=\"");
+	    wString(w, value);
+	    wLiteral(w, "\"");
+	}
+    }
+}
 
-	case XML_UNNAMEDTAG:
-	    fprintf(file, ": tag without name found "
-		    "at line %ld, column %ld.\n", doc->line, doc->col);
-	    break;
+static void
+wClose(struct xmlWriter *w, const XmlElement *element)
+{
+    wLiteral(w, "</");
+    wString(w, element->name);
+    wLiteral(w, ">");
+}
 
-	case XML_UNNAMEDATTR:
-	    fprintf(file, ": attribute without name found "
-		    "at line %ld, column %ld.\n", doc->line, doc->col);
-	    break;
+static void
+writeDoc(const XmlDoc *doc, struct xmlWriter *w, int flags)
+{
+    const XmlElement *e = doc->root;
+    const XmlElement *child;
+    const char *value;
+    int pretty = !(flags & XML_WRITE_COMPACT);
 
-	case XML_UNMATCHEDCLOSE:
-	    fprintf(file, ": closing tag doesn't match <%s> at line %ld, "
-		    "column %ld\n", doc->errInfo.s, doc->line, doc->col);
+    while (!w->err)
+    {
+	MATERIALIZE(e);
+	if (doc->err == XML_NOMEM)
+	{
+	    /* some lazily parsed content couldn't be built */
+	    errno = ENOMEM;
+	    w->err = 1;
 	    break;
+	}
+	if (pretty && e->parent) wNewline(w, e);
+	wLiteral(w, "<");
+	wString(w, e->name);
+	wAttributes(w, e);
+	child = childOf(e);
+	value = contentOf(e);
+	if (child || value || !pretty)
+	{
+	    /* compact output doesn't use "<x />" because the space is
+	     * needed when reading it back */
+	    wLiteral(w, ">");
+	    if (value) wString(w, value);
+	    if (child)
+	    {
+		e = child;
+		continue;
+	    }
+	    wClose(w, e);
+	}
+	else wLiteral(w, " />");
 
-	case XML_CLOSEWOOPEN:
-	    fprintf(file, ": closing tag </%s> was never opened at line %ld, "
-		    "column %ld\n", doc->errInfo.s, doc->line, doc->col);
-	    break;
+	/* close all elements this was the last child of */
+	while (e->parent && !e->next)
+	{
+	    e = parentOf(e);
+	    if (pretty) wNewline(w, e);
+	    wClose(w, e);
+	}
+	if (!e->parent) break;
+	e = e + e->next;
+    }
+}
 
-	case XML_UNEXPECTED:
-	    fprintf(file, ": found unexpected character `%c' at line %ld, "
-		    "column %ld\n", doc->errInfo.c, doc->line, doc->col);
-	    break;
+int
+xmlWrite(const XmlDoc *doc, XmlSink *sink, int flags)
+{
+    struct xmlWriter w;
+    char buf[WRITEBUF_SIZE];
 
-	default:
-	    fputs(": unknown error (aka BUG).\n", file);
+    if (!doc || !doc->root) return -1;
+
+    w.sink = sink;
+    w.buf = buf;
+    w.used = 0;
+    w.size = sizeof buf;
+    w.err = 0;
+    writeDoc(doc, &w, flags);
+    wFlush(&w, 0, 0);
+    return w.err ? -1 : 0;
+}
+
+char *
+xmlText(const XmlDoc *doc)
+{
+    struct xmlWriter w;
+
+    if (!doc || !doc->root) return 0;
+
+    w.sink = 0;
+    w.used = 0;
+    w.size = 1024;
+    w.err = 0;
+    if (!(w.buf = malloc(w.size))) return 0;
+    writeDoc(doc, &w, XML_WRITE_PRETTY);
+    wAppend(&w, "", 1);
+    if (w.err)
+    {
+	free(w.buf);
+	return 0;
     }
+    return w.buf;
 }
 
-XmlElement *
-firstChild(const XmlElement *element)
+/* binary images: the elements, attributes and strings of a document in one
+ * block, with offsets from the start of the image in place of pointers.
+ * The elements are one block in document order, whose links need no
+ * change. Loading maps the file and turns the offsets back into pointers,
+ * so the image is used through the normal API without parsing or
+ * allocating nodes. Images depend on the pointer size, byte order and
+ * structure layout, which are recorded in the header. */
+#define BINARY_VERSION 4
+
+static const char binaryMagic[8] = { 'b', 'a', 'd', 'x', 'm', 'l', 'B', 0 };
+static const unsigned int binaryOrder = 1;
+
+#define BINARY_LAYOUT ((unsigned long)(sizeof(void *) \
+	| sizeof(XmlElement) << 8 | sizeof(XmlAttribute) << 16) \
+	| (unsigned long)*(const unsigned char *)&binaryOrder << 24)
+
+struct binaryHeader
 {
-    return element->children;
+    char magic[8];
+    unsigned long version;
+    unsigned long layout;
+    unsigned long checksum;
+    size_t size;
+    size_t elements;
+    size_t nelements;
+    size_t attributes;
+    size_t nattributes;
+    size_t rowBytes;
+    size_t names;
+    size_t nnames;
+};
+
+/* pointer members hold offsets, 0 stands for a null pointer */
+#define toOffset(off) ((void *)(size_t)(off))
+#define fromOffset(p, base) ((p) ? (void *)((base) + (size_t)(p)) : 0)
+
+/* numbers for elements or names while building an image */
+struct offsetMap
+{
+    const void **keys;
+    size_t *values;
+    size_t size;
+    size_t count;
+};
+
+static size_t *mapSlot(struct offsetMap *m, const void *key);
+
+/* returns -1 if memory ran out, leaving m alone */
+static int
+growMap(struct offsetMap *m)
+{
+    struct offsetMap grown;
+    size_t i;
+
+    grown.size = m->size ? m->size * 2 : 256;
+    grown.keys = allocMem(&globalAllocator, grown.size * sizeof *grown.keys);
+    grown.values = allocMem(&globalAllocator,
+	    grown.size * sizeof *grown.values);
+    if (!grown.keys || !grown.values)
+    {
+	releaseMem(&globalAllocator, grown.keys,
+		grown.size * sizeof *grown.keys);
+	releaseMem(&globalAllocator, grown.values,
+		grown.size * sizeof *grown.values);
+	return -1;
+    }
+    memset(grown.keys, 0, grown.size * sizeof *grown.keys);
+    grown.count = 0;
+    for (i = 0; i < m->size; ++i) if (m->keys[i])
+    {
+	*mapSlot(&grown, m->keys[i]) = m->values[i];
+    }
+    releaseMem(&globalAllocator, m->keys, m->size * sizeof *m->keys);
+    releaseMem(&globalAllocator, m->values, m->size * sizeof *m->values);
+    *m = grown;
+    return 0;
 }
 
-XmlElement *
-lastChild(const XmlElement *element)
+/* the value slot of key, added as 0 if it's new. Returns 0 only if memory
+ * ran out adding it, looking up a key already there always works. */
+static size_t *
+mapSlot(struct offsetMap *m, const void *key)
 {
-    return (element->children ? element->children->prev : 0);
+    size_t i;
+
+    if (!m->size && growMap(m) < 0) return 0;
+    for (i = hashPointer(key) & (m->size - 1); m->keys[i] && m->keys[i] != key;
+	    i = (i + 1) & (m->size - 1));
+    if (!m->keys[i])
+    {
+	if ((m->count + 1) * 2 > m->size)
+	{
+	    return growMap(m) < 0 ? 0 : mapSlot(m, key);
+	}
+	m->keys[i] = key;
+	m->values[i] = 0;
+	++m->count;
+    }
+    return m->values + i;
 }
 
-XmlElement *
-nextSibling(const XmlElement *element)
+/* 32bit FNV-1a over words of the image following the header, in four
+ * independent lanes so it isn't limited by the latency of multiplying */
+static unsigned long
+binaryChecksum(const char *image, size_t size)
 {
-    return (element->parent && element->next != element->parent->children ?
-	    element->next : 0);
+    unsigned long hash[4] = { 2166136261UL, 2166136261UL,
+	2166136261UL, 2166136261UL };
+    unsigned int word[4];
+    size_t i, lane;
+
+    for (i = sizeof(struct binaryHeader); i + sizeof word <= size;
+	    i += sizeof word)
+    {
+	memcpy(word, image + i, sizeof word);
+	for (lane = 0; lane < 4; ++lane)
+	{
+	    hash[lane] ^= word[lane];
+	    hash[lane] = (hash[lane] * 16777619UL) & 0xffffffffUL;
+	}
+    }
+    for (; i + sizeof *word <= size; i += sizeof *word)
+    {
+	memcpy(word, image + i, sizeof *word);
+	hash[0] ^= word[0];
+	hash[0] = (hash[0] * 16777619UL) & 0xffffffffUL;
+    }
+    for (lane = 1; lane < 4; ++lane)
+    {
+	hash[0] ^= hash[lane];
+	hash[0] = (hash[0] * 16777619UL) & 0xffffffffUL;
+    }
+    return hash[0];
 }
 
-XmlElement *
-parentElement(const XmlElement *element)
+static void *
+binaryString(char *image, size_t *pos, const char *s)
 {
-    return element->parent;
+    size_t len;
+    size_t offset = *pos;
+
+    if (!s) return 0;
+    len = strlen(s) + 1;
+    memcpy(image + offset, s, len);
+    *pos += len;
+    return toOffset(offset);
 }
 
-XmlElement *
-findMatching(const XmlElement *element,
-	const char *tagname, const char *attname, const char *attval)
+/* build the image of doc in a buffer from the global allocator */
+static char *
+binaryImage(const XmlDoc *doc, size_t *size)
 {
-    XmlElement *found = (XmlElement *)element;
-    XmlAttribute *att = element->attributes;
-    XmlElement *elem = element->children;
+    struct binaryHeader h;
+    struct offsetMap elements = { 0, 0, 0, 0 };
+    struct offsetMap names = { 0, 0, 0, 0 };
+    const XmlElement *e, *link;
+    const XmlAttribute *a, *end;
+    XmlElement *outE;
+    XmlAttribute *outA;
+    size_t *slot;
+    size_t nameBytes = 0;
+    size_t valueBytes = 0;
+    size_t i, n, row, pos;
+    char *image;
 
-    if (!tagname || !strcmp(tagname, element->name))
+    /* count nodes and string bytes, numbering elements and giving each
+     * interned name its offset (+1) among the names */
+    memset(&h, 0, sizeof h);
+    image = 0;
+    for (e = doc->root; e; e = nextElement(e, doc->root))
     {
-	if (attname && att) do
+	MATERIALIZE(e);
+	if (!(slot = mapSlot(&elements, e))) goto nomem;
+	*slot = h.nelements++;
+	if (!(slot = mapSlot(&names, e->name))) goto nomem;
+	if (!*slot)
 	{
-	    if (!strcmp(attname, att->name) &&
-		   (!attval || !strcmp(attval, att->value)))
+	    *slot = nameBytes + 1;
+	    nameBytes += strlen(e->name) + 1;
+	}
+	if (contentOf(e)) valueBytes += strlen(contentOf(e)) + 1;
+	h.nattributes += e->natts;
+	h.rowBytes += e->natts * sizeof *e->attributes;
+	if (e->natts >= ATTTABLE_MIN) h.rowBytes += ATTTABLE_HEAD;
+	for (a = e->attributes, end = a + e->natts; a != end; ++a)
+	{
+	    if (!(slot = mapSlot(&names, a->name))) goto nomem;
+	    if (!*slot)
 	    {
-		return found;
+		*slot = nameBytes + 1;
+		nameBytes += strlen(a->name) + 1;
 	    }
-	    att = att->next;
-	} while (att != element->attributes);
-	else return found;
+	    if (a->value) valueBytes += strlen(a->value) + 1;
+	}
     }
+    /* building lazily parsed content may have run out of memory */
+    if (doc->err == XML_NOMEM) goto nomem;
+
+    memcpy(h.magic, binaryMagic, sizeof h.magic);
+    h.version = BINARY_VERSION;
+    h.layout = BINARY_LAYOUT;
+    h.nnames = names.count;
+    h.elements = ARENA_ALIGNED(sizeof h) + BLOCK_HEAD;
+    h.attributes = h.elements + h.nelements * sizeof(XmlElement);
+    h.names = ARENA_ALIGNED(h.attributes + h.rowBytes);
+    pos = h.names + h.nnames * sizeof(size_t);
+    h.size = ARENA_ALIGNED(pos + nameBytes + valueBytes);
+    if (!(image = allocMem(&globalAllocator, h.size))) goto nomem;
+    memset(image, 0, h.size);
 
-    if (elem) do
+    /* the name strings and a table of them for rebuilding the name table */
+    for (i = 0, n = 0; i < names.size; ++i) if (names.keys[i])
     {
-	found = findMatching(elem, tagname, attname, attval);
-	if (found) return found;
-	elem = elem->next;
-    } while (elem != element->children);
+	names.values[i] += pos - 1;
+	memcpy(image + names.values[i], names.keys[i],
+		strlen(names.keys[i]) + 1);
+	((size_t *)(image + h.names))[n++] = names.values[i];
+    }
+    pos += nameBytes;
 
-    return 0;
-}
+    /* links are distances between element numbers, attribute rows follow
+     * each other with room for the tables of large ones */
+    outE = (XmlElement *)(image + h.elements);
+    row = h.attributes;
+    for (e = doc->root, i = 0; e; e = nextElement(e, doc->root), ++outE, ++i)
+    {
+	outE->name = toOffset(*mapSlot(&names, e->name));
+	outE->value = binaryString(image, &pos, contentOf(e));
+	link = parentOf(e);
+	outE->parent = link ? (unsigned int)(i - *mapSlot(&elements, link)) : 0;
+	link = nextOf(e);
+	outE->next = link ? (unsigned int)(*mapSlot(&elements, link) - i) : 0;
+	link = lastChildOf(e);
+	outE->last = link ? (unsigned int)(*mapSlot(&elements, link) - i) : 0;
+	outE->index = (unsigned int)i;
+	outE->natts = e->natts;
+	outE->depth = e->depth;
+	outE->attributes = 0;
+	if (!e->natts) continue;
 
-XmlAttribute *
-firstAttribute(const XmlElement *element)
-{
-    return element->attributes;
-}
+	if (e->natts >= ATTTABLE_MIN) row += ATTTABLE_HEAD;
+	outE->attributes = toOffset(row);
+	outA = (XmlAttribute *)(image + row);
+	for (a = e->attributes, end = a + e->natts; a != end; ++a, ++outA)
+	{
+	    outA->name = toOffset(*mapSlot(&names, a->name));
+	    outA->value = binaryString(image, &pos, a->value);
+	}
+	row += e->natts * sizeof *e->attributes;
+    }
 
-XmlAttribute *
-nextAttribute(const XmlAttribute *attribute)
-{
-    return (attribute->next != attribute->parent->attributes ?
-	    attribute->next : 0);
-}
+    h.checksum = binaryChecksum(image, h.size);
+    memcpy(image, &h, sizeof h);
+    *size = h.size;
+    goto done;
 
-XmlElement *
-attributeElement(const XmlAttribute *attribute)
-{
-    return attribute->parent;
+nomem:
+    errno = ENOMEM;
+
+done:
+    releaseMem(&globalAllocator, elements.keys,
+	    elements.size * sizeof *elements.keys);
+    releaseMem(&globalAllocator, elements.values,
+	    elements.size * sizeof *elements.values);
+    releaseMem(&globalAllocator, names.keys, names.size * sizeof *names.keys);
+    releaseMem(&globalAllocator, names.values,
+	    names.size * sizeof *names.values);
+    return image;
 }
 
-const char *
-tagName(const XmlElement *element)
+int
+xmlSaveBinary(const XmlDoc *doc, const char *path)
 {
-    return element->name;
+    FILE *file;
+    char *image;
+    size_t size;
+    int rc = 0;
+
+    if (!doc || !doc->root)
+    {
+	errno = EINVAL;
+	return -1;
+    }
+    if (!(image = binaryImage(doc, &size))) return -1;
+    if (!(file = fopen(path, "wb")))
+    {
+	releaseMem(&globalAllocator, image, size);
+	return -1;
+    }
+    if (fwrite(image, 1, size, file) != size) rc = -1;
+    if (fclose(file) != 0) rc = -1;
+    releaseMem(&globalAllocator, image, size);
+    return rc;
 }
 
-const char *
-elementContent(const XmlElement *element)
+/* whether count nodes of nodeSize bytes fit between start and end */
+static int
+fitsImage(size_t start, size_t count, size_t nodeSize, size_t end)
 {
-    return element->value;
+    return start <= end && count <= (end - start) / nodeSize;
 }
 
-const char *
-attributeName(const XmlAttribute *attribute)
+/* whether an offset is 0 or points into the strings at the end of an image
+ * of size bytes. The image ends with a 0 byte, so they are terminated. */
+static int
+isStringOffset(const void *p, size_t strings, size_t size)
 {
-    return attribute->name;
+    size_t off = (size_t)p;
+
+    return !off || (off >= strings && off < size);
 }
 
-const char *
-attributeValue(const XmlAttribute *attribute)
+/* whether the links of n elements in document order make up their tree:
+ * each parent is an ancestor of the element before, siblings link to each
+ * other and to their parent's last child, and nothing else is linked. So
+ * walking a damaged image can't leave it or loop. */
+static int
+isImageTree(const XmlElement *elements, size_t n)
 {
-    return attribute->value;
+    const XmlElement *e, *p, *q, *prev;
+    size_t i, nexts = 0, links = 0;
+
+    if (elements->parent || elements->next || elements->depth) return 0;
+    for (i = 1; i < n; ++i)
+    {
+	e = elements + i;
+	if (!e->parent || e->parent > i) return 0;
+	p = e - e->parent;
+	if (e->depth != p->depth + 1) return 0;
+
+	/* the child of p before e is the one holding the element before */
+	for (q = e - 1, prev = 0; q->depth > p->depth; q -= q->parent) prev = q;
+	if (q != p) return 0;
+	if (prev ? prev->next != (unsigned int)(e - prev) : !p->last) return 0;
+	if (prev) ++links;
+    }
+    for (i = 0, e = elements; i < n; ++i, ++e)
+    {
+	if (e->next) ++nexts;
+	if (!e->last) continue;
+	if (e->last > n - 1 - i) return 0;
+	q = e + e->last;
+	if (q - q->parent != e || q->next) return 0;
+    }
+    return nexts == links;
 }
 
-static void
-xmlAttributeText(struct stringBuilder *sb, const XmlAttribute *attribute)
+/* check an image and turn its offsets into pointers. Every offset is
+ * checked before it is used, attribute rows must not overlap and the links
+ * must make up a tree. Returns 0 with errno set to EINVAL if the image
+ * isn't valid, or to ENOMEM if memory ran out. */
+static XmlDoc *
+loadImage(char *image, size_t size)
 {
-    sbAppend(sb, " ");
-    sbAppend(sb, attribute->name);
-    sbAppend(sb, "=");
-    if (strchr(attribute->value, '"'))
+    struct binaryHeader h;
+    XmlDoc *doc;
+    struct nodeBlock *b;
+    XmlElement *e;
+    XmlAttribute *a, *end;
+    const size_t *name;
+    struct nameEntry *entry;
+    size_t i, len, strings, off, row, rows, natts = 0;
+
+    errno = EINVAL;
+    if (size < sizeof h) return 0;
+    memcpy(&h, image, sizeof h);
+    if (memcmp(h.magic, binaryMagic, sizeof h.magic)
+	    || h.version != BINARY_VERSION || h.layout != BINARY_LAYOUT
+	    || h.size != size || !h.nelements || image[size - 1]
+	    || h.elements != ARENA_ALIGNED(sizeof h) + BLOCK_HEAD
+	    || !fitsImage(h.elements, h.nelements, sizeof(XmlElement), size)
+	    || h.attributes != h.elements + h.nelements * sizeof(XmlElement)
+	    || h.rowBytes > size - h.attributes
+	    || h.names != ARENA_ALIGNED(h.attributes + h.rowBytes)
+	    || !fitsImage(h.names, h.nnames, sizeof(size_t), size)
+	    || h.checksum != binaryChecksum(image, size)) return 0;
+    strings = h.names + h.nnames * sizeof(size_t);
+    rows = h.attributes + h.rowBytes;
+
+#define STRING(p) (isStringOffset((p), strings, size))
+
+    /* rows come in the order of their elements, each one behind the
+     * previous one and the slot for its table */
+    row = h.attributes;
+    for (i = 0, e = (XmlElement *)(image + h.elements); i < h.nelements;
+	    ++i, ++e)
     {
-	if (strchr(attribute->value, '\''))
+	if (!e->name || !STRING(e->name) || !STRING(e->value)
+		|| e->index != i || e->lazy || e->stub || e->external
+		|| !e->natts != !e->attributes) return 0;
+	e->name = fromOffset(e->name, image);
+	e->value = fromOffset(e->value, image);
+	if (!e->natts) continue;
+
+	off = (size_t)e->attributes;
+	if (e->natts >= ATTTABLE_MIN) row += ATTTABLE_HEAD;
+	if (off < row || (off - h.attributes) % sizeof(char *)
+		|| !fitsImage(off, e->natts, sizeof(XmlAttribute), rows))
 	{
-	    sbAppend(sb, "\"\"");
+	    return 0;
 	}
-	else
+	row = off + e->natts * sizeof(XmlAttribute);
+	natts += e->natts;
+	e->attributes = fromOffset(e->attributes, image);
+	for (a = e->attributes, end = a + e->natts; a != end; ++a)
 	{
-	    sbAppend(sb, "'");
-	    sbAppend(sb, attribute->value);
-	    sbAppend(sb, "'");
+	    if (!a->name || !STRING(a->name) || !STRING(a->value)) return 0;
+	    a->name = fromOffset(a->name, image);
+	    a->value = fromOffset(a->value, image);
+	    a->parent = e;
 	}
     }
-    else
+    for (i = 0, name = (const size_t *)(image + h.names); i < h.nnames;
+	    ++i, ++name)
     {
-	sbAppend(sb, "\"");
-	sbAppend(sb, attribute->value);
-	sbAppend(sb, "\"");
+	if (!*name || !STRING(toOffset(*name))) return 0;
     }
-    if (attribute->next != attribute->parent->attributes)
-	xmlAttributeText(sb, attribute->next);
-}
 
-static void
-xmlElementText(struct stringBuilder *sb, const XmlElement *element)
-{
-    unsigned int i;
+#undef STRING
+
+    if (natts != h.nattributes
+	    || !isImageTree((XmlElement *)(image + h.elements), h.nelements))
+    {
+	return 0;
+    }
 
-    if (element->parent) sbAppend(sb, "\n");
-    for (i = 0; i < element->depth; ++i) sbAppend(sb, "  ");
-    sbAppend(sb, "<");
-    sbAppend(sb, element->name);
-    if (element->attributes) xmlAttributeText(sb, element->attributes);
-    if (element->children || element->value)
+    /* names in the image are the interned names of the document */
+    if (!(doc = newDoc("", 0, 0))) return 0;
+    for (i = 0, name = (const size_t *)(image + h.names); i < h.nnames;
+	    ++i, ++name)
     {
-	sbAppend(sb, ">");
-	if (element->value) sbAppend(sb, element->value);
-	if (element->children)
+	len = strlen(image + *name);
+	if (doc->ownNames.count * 2 >= doc->ownNames.size
+		&& growNames(&doc->ownNames) < 0)
 	{
-	    xmlElementText(sb, element->children);
-	    sbAppend(sb, "\n");
-	    for (i = 0; i < element->depth; ++i) sbAppend(sb, "  ");
+	    goto nomem;
 	}
-	sbAppend(sb, "</");
-	sbAppend(sb, element->name);
-	sbAppend(sb, ">");
+	entry = findName(&doc->ownNames, image + *name, len,
+		hashName(image + *name, len));
+	entry->name = image + *name;
+	entry->len = len;
+	entry->hash = hashName(image + *name, len);
+	++doc->ownNames.count;
     }
-    else sbAppend(sb, " />");
-    if (element->parent && element->next != element->parent->children)
-	xmlElementText(sb, element->next);
+
+    /* the elements are a block of the document, with the slot for the
+     * block in front of them */
+    if (!(b = newBlock(doc))) goto nomem;
+    b->elements = (XmlElement *)(image + h.elements);
+    b->count = b->size = h.nelements;
+    b->image = 1;
+    ((struct nodeBlock **)(void *)b->elements)[-1] = b;
+
+    /* attribute tables are not part of the image */
+    for (i = 0, e = b->elements; i < h.nelements; ++i, ++e)
+    {
+	if (e->natts >= ATTTABLE_MIN && tableAttributes(doc, e, 0) < 0)
+	{
+	    goto nomem;
+	}
+    }
+    doc->root = b->elements;
+    doc->image = image;
+    doc->imageSize = size;
+    return doc;
+
+nomem:
+    /* the image stays with the caller */
+    freeDoc(doc);
+    errno = ENOMEM;
+    return 0;
 }
 
-char *
-xmlText(const XmlDoc *doc)
+#ifdef WIN32
+XmlDoc *
+xmlLoadBinary(const char *path)
 {
-    struct stringBuilder sb;
+    XmlDoc *doc;
+    FILE *file;
+    char *image;
+    long size;
 
-    if (!doc || !doc->root) return 0;
+    if (!(file = fopen(path, "rb"))) return 0;
+    if (fseek(file, 0, SEEK_END) < 0 || (size = ftell(file)) < 0
+	    || fseek(file, 0, SEEK_SET) < 0)
+    {
+	fclose(file);
+	return 0;
+    }
+    if (!size)
+    {
+	fclose(file);
+	errno = EINVAL;
+	return 0;
+    }
+    if (!(image = allocMem(&globalAllocator, (size_t)size)))
+    {
+	fclose(file);
+	return 0;
+    }
+    if (fread(image, 1, (size_t)size, file) != (size_t)size)
+    {
+	releaseMem(&globalAllocator, image, (size_t)size);
+	fclose(file);
+	return 0;
+    }
+    fclose(file);
+    if (!(doc = loadImage(image, (size_t)size)))
+    {
+	releaseMem(&globalAllocator, image, (size_t)size);
+    }
+    return doc;
+}
+#else
+XmlDoc *
+xmlLoadBinary(const char *path)
+{
+    XmlDoc *doc;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) return 0;
+    if (fstat(fd, &st) < 0)
+    {
+	close(fd);
+	return 0;
+    }
+    if (!st.st_size)
+    {
+	close(fd);
+	errno = EINVAL;
+	return 0;
+    }
 
-    sbInit(&sb);
-    xmlElementText(&sb, doc->root);
-    return sb.buf;
+    /* a private writable mapping, only pages with nodes are copied when
+     * their offsets are replaced, strings are read from the file */
+    map = mmap(0, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	    fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    if (!(doc = loadImage(map, (size_t)st.st_size)))
+    {
+	munmap(map, (size_t)st.st_size);
+    }
+    return doc;
 }
+#endif
 
 #ifdef BADXML_DEBUG
 static void
-dumpXmlAttribute(const XmlAttribute *a, FILE *file, int shift)
+dumpXmlAttribute(const XmlElement *e, FILE *file, int shift)
 {
+    const XmlAttribute *a, *end;
     int i;
 
-    if (!a) return;
+    for (a = e->attributes, end = a + e->natts; a != end; ++a)
+    {
+	for (i=0; i<shift; ++i) fputs(" ", file);
+	fprintf(file, "[XmlAttribute]: %s, value: %s\n", a->name, a->value);
+    }
+}
+
+static void
+dumpXmlValue(const XmlElement *e, FILE *file, int shift)
+{
+    int i;
 
-    for (i=0; i<shift; ++i) fputs(" ", file);
-    fprintf(file, "[XmlAttribute]: %s, value: %s\n", a->name, a->value);
-    if (a->next != a->parent->attributes)
-	dumpXmlAttribute(a->next, file, shift);
+    if (contentOf(e))
+    {
+	for (i=0; i<shift; ++i) fputs(" ", file);
+	fprintf(file, "  value: %s\n", contentOf(e));
+    }
 }
 
 static void
 dumpXmlElement(const XmlElement *e, FILE *file, int shift)
 {
+    const XmlElement *top = e;
     int i;
 
     if (!e) return;
 
-    for (i=0; i<shift; ++i) fputs(" ", file);
-    fprintf(file, "[XmlElement]: %s\n", e->name);
-    dumpXmlAttribute(e->attributes, file, shift+2);
-    if (e->children)
-    {
-	dumpXmlElement(e->children, file, shift+2);
-    }
-    if (e->value)
+    while (1)
     {
 	for (i=0; i<shift; ++i) fputs(" ", file);
-	fprintf(file, "  value: %s\n", e->value);
-    }
-    if (e->parent && e->next != e->parent->children)
-    {
-	dumpXmlElement(e->next, file, shift);
+	fprintf(file, "[XmlElement]: %s\n", e->name);
+	dumpXmlAttribute(e, file, shift+2);
+	MATERIALIZE(e);
+	if (childOf(e))
+	{
+	    e = childOf(e);
+	    shift += 2;
+	    continue;
+	}
+	dumpXmlValue(e, file, shift);
+	while (e != top && !e->next)
+	{
+	    e = parentOf(e);
+	    shift -= 2;
+	    dumpXmlValue(e, file, shift);
+	}
+	if (e == top) return;
+	e = e + e->next;
     }
 }
 
@@ -0,0 +1,390 @@
+#ifndef WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include <badxml/badxml.h>
+
+/* generated document text, grown as needed */
+struct corpus
+{
+    char *text;
+    size_t len;
+    size_t size;
+};
+
+static void putN(struct corpus *c, const char *s, size_t n)
+{
+    if (c->len + n + 1 > c->size)
+    {
+	c->size = c->size ? c->size * 2 : 4096;
+	while (c->len + n + 1 > c->size) c->size *= 2;
+	c->text = realloc(c->text, c->size);
+    }
+    memcpy(c->text + c->len, s, n);
+    c->len += n;
+    c->text[c->len] = '\0';
+}
+
+static void put(struct corpus *c, const char *s)
+{
+    putN(c, s, strlen(s));
+}
+
+static void putNum(struct corpus *c, long n)
+{
+    char num[32];
+
+    sprintf(num, "%ld", n);
+    put(c, num);
+}
+
+static void generateWide(struct corpus *c, long count)
+{
+    long i;
+
+    /* one root element with count children */
+    put(c, "<root>");
+    for (i = 0; i < count; ++i)
+    {
+	put(c, "\n  <item id=\"x\" class='c'>some text</item>");
+    }
+    put(c, "\n</root>");
+}
+
+static void generateMixed(struct corpus *c, long count)
+{
+    long i;
+
+    /* text of the root element interleaved with count children */
+    put(c, "<root>");
+    for (i = 0; i < count; ++i) put(c, "some text <b>bold</b> ");
+    put(c, "</root>");
+}
+
+static void generateDeep(struct corpus *c, long count)
+{
+    long i;
+
+    /* count elements, each nested in the previous one */
+    for (i = 0; i < count; ++i) put(c, "<a>");
+    put(c, "text");
+    for (i = 0; i < count; ++i) put(c, "</a>");
+}
+
+static void generateAttrs(struct corpus *c, long count)
+{
+    long i;
+    long j;
+
+    /* elements with 20 attributes each, count nodes in total */
+    put(c, "<root>");
+    for (i = 0; i < count / 21; ++i)
+    {
+	put(c, "\n  <entry");
+	for (j = 0; j < 20; ++j)
+	{
+	    put(c, " attribute");
+	    putNum(c, j);
+	    put(c, "=\"value ");
+	    putNum(c, i);
+	    put(c, "\"");
+	}
+	put(c, " />");
+    }
+    put(c, "\n</root>");
+}
+
+static void generateText(struct corpus *c, long count)
+{
+    static const char words[] = " Lorem ipsum dolor sit amet, consectetur "
+	"adipiscing elit, sed do eiusmod tempor incididunt ut labore et "
+	"dolore magna aliqua.";
+    long i;
+    int j;
+
+    /* paragraphs of about 1KB text, one per 16 nodes of count */
+    put(c, "<doc>");
+    for (i = 0; i < count / 16; ++i)
+    {
+	put(c, "\n  <p>");
+	for (j = 0; j < 9; ++j) put(c, words);
+	put(c, "</p>");
+    }
+    put(c, "\n</doc>");
+}
+
+static void generateLarge(struct corpus *c, long count)
+{
+    long i;
+
+    /* a catalog of records mixing all of the above, 12 nodes each */
+    put(c, "<?xml version=\"1.0\"?>\n<catalog>");
+    for (i = 0; i < count / 12; ++i)
+    {
+	put(c, "\n  <record id=\"r");
+	putNum(c, i);
+	put(c, "\" kind='k");
+	putNum(c, i % 7);
+	put(c, "'>\n    <name>Record number ");
+	putNum(c, i);
+	put(c, "</name>\n    <price cur=\"EUR\">");
+	putNum(c, i % 1000);
+	put(c, ".99</price>\n    <tags><tag>red</tag><tag>blue</tag></tags>"
+		"\n    <desc>Text of record ");
+	putNum(c, i);
+	put(c, " with <em>some</em> markup.</desc>\n  </record>");
+    }
+    put(c, "\n</catalog>");
+}
+
+struct kind
+{
+    const char *name;
+    void (*generate)(struct corpus *, long);
+    long scale;
+    int serialize;
+};
+
+/* xmlText indents by depth, so its output would grow quadratically for
+ * the deep document */
+static const struct kind kinds[] = {
+    { "wide", generateWide, 1, 1 },
+    { "mixed", generateMixed, 1, 1 },
+    { "deep", generateDeep, 1, 0 },
+    { "attrs", generateAttrs, 1, 1 },
+    { "text", generateText, 1, 1 },
+    { "large", generateLarge, 4, 1 },
+    { 0, 0, 0, 0 }
+};
+
+static double seconds(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/* amount per second, 0 if too fast to measure */
+static double rate(double amount, double secs)
+{
+    return secs > 0 ? amount / secs : 0;
+}
+
+/* peak resident set size of the process in KB, or -1 if unknown */
+static long peakRss(void)
+{
+#ifdef WIN32
+    return -1;
+#else
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0) return -1;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static int run(const char *name, const char *text, size_t len,
+	int rounds, int serialize, int json)
+{
+    XmlDoc *doc;
+    XmlParseOptions options;
+    XmlStats stats;
+    char *xml;
+    double parse = 0, find = 0, dump = 0, release = 0, nodes;
+    double mb = (double)len / 1e6;
+    clock_t start;
+    int i;
+
+    /* counts come from a parse of their own, the timed ones don't collect
+     * statistics */
+    memset(&options, 0, sizeof options);
+    options.stats = &stats;
+    doc = parseDocWith(text, len, &options);
+    if (xmlDocError(doc) != XML_SUCCESS)
+    {
+	xmlDocPerror(doc, stderr, "Error parsing %s document", name);
+	freeDoc(doc);
+	return 1;
+    }
+    freeDoc(doc);
+    nodes = (double)(stats.elements + stats.attributes);
+
+    for (i = 0; i < rounds; ++i)
+    {
+	start = clock();
+	doc = parseDocN(text, len);
+	parse += seconds(start);
+
+	/* a search that doesn't match visits every element */
+	start = clock();
+	findMatching(rootElement(doc), "nomatch", 0, 0);
+	find += seconds(start);
+
+	if (serialize)
+	{
+	    start = clock();
+	    xml = xmlText(doc);
+	    dump += seconds(start);
+	    free(xml);
+	}
+
+	start = clock();
+	freeDoc(doc);
+	release += seconds(start);
+    }
+    parse /= rounds;
+    find /= rounds;
+    dump /= rounds;
+    release /= rounds;
+
+    if (json)
+    {
+	printf("{\"kind\":\"%s\",\"bytes\":%lu,\"nodes\":%.0f,\"rounds\":%d,"
+		"\"parse_s\":%.6f,\"parse_mbs\":%.1f,\"parse_ns_node\":%.1f,"
+		"\"find_s\":%.6f,\"find_ns_node\":%.1f,", name,
+		(unsigned long)len, nodes, rounds, parse, rate(mb, parse),
+		rate(parse * 1e9, nodes), find, rate(find * 1e9, nodes));
+	if (serialize)
+	{
+	    printf("\"text_s\":%.6f,\"text_mbs\":%.1f,", dump,
+		    rate(mb, dump));
+	}
+	printf("\"free_s\":%.6f,\"elements\":%lu,\"attributes\":%lu,"
+		"\"texts\":%lu,\"max_depth\":%lu,\"allocs\":%lu,"
+		"\"alloc_bytes\":%lu,\"peak_live_bytes\":%lu,"
+		"\"peak_rss_kb\":%ld}\n", release,
+		(unsigned long)stats.elements, (unsigned long)stats.attributes,
+		(unsigned long)stats.texts, (unsigned long)stats.maxDepth,
+		(unsigned long)stats.allocations,
+		(unsigned long)stats.allocated,
+		(unsigned long)stats.peakLive, peakRss());
+    }
+    else
+    {
+	printf("%-5s %8.1f MB %9.0f nodes  parse %7.3fs (%7.1f MB/s, "
+		"%5.1f ns/node)  find %7.3fs  text %7.3fs  free %7.3fs  "
+		"%lu allocs (%.1f MB)  peak RSS %ld KB\n", name, mb, nodes,
+		parse, rate(mb, parse), rate(parse * 1e9, nodes), find, dump,
+		release, (unsigned long)stats.allocations,
+		(double)stats.allocated / 1e6, peakRss());
+    }
+    return 0;
+}
+
+static int usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-j] [-n nodes] [-r rounds] [-o file | "
+	    "-f file] [kind ...]\n"
+	    "  -j       print one JSON object per benchmark\n"
+	    "  -n nodes size of generated documents (default 1000000)\n"
+	    "  -r rounds  repetitions to average (default 5)\n"
+	    "  -o file  only write the generated document (one kind)\n"
+	    "  -f file  benchmark the document in file instead\n"
+	    "kinds: wide mixed deep attrs text large (default: all)\n",
+	    prog);
+    return 1;
+}
+
+static int writeCorpus(const char *path, const struct corpus *c)
+{
+    FILE *file;
+    int rc = 0;
+
+    if (!(file = fopen(path, "wb")))
+    {
+	perror(path);
+	return 1;
+    }
+    if (fwrite(c->text, 1, c->len, file) != c->len) rc = 1;
+    if (fclose(file) != 0) rc = 1;
+    if (rc) perror(path);
+    return rc;
+}
+
+static int readCorpus(const char *path, struct corpus *c)
+{
+    FILE *file;
+    char buf[65536];
+    size_t n;
+
+    if (!(file = fopen(path, "rb")))
+    {
+	perror(path);
+	return 1;
+    }
+    put(c, "");
+    while ((n = fread(buf, 1, sizeof buf, file)) > 0) putN(c, buf, n);
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct corpus c = { 0, 0, 0 };
+    const struct kind *k;
+    const char *outFile = 0;
+    const char *inFile = 0;
+    long count = 1000000;
+    int rounds = 5;
+    int json = 0;
+    int selected = 0;
+    int rc = 0;
+    int i;
+    int j;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; ++i)
+    {
+	if (!strcmp(argv[i], "-j")) json = 1;
+	else if (i + 1 == argc) return usage(argv[0]);
+	else if (!strcmp(argv[i], "-n")) count = atol(argv[++i]);
+	else if (!strcmp(argv[i], "-r")) rounds = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "-o")) outFile = argv[++i];
+	else if (!strcmp(argv[i], "-f")) inFile = argv[++i];
+	else return usage(argv[0]);
+    }
+    if (count < 1 || rounds < 1) return usage(argv[0]);
+    for (j = i; j < argc; ++j)
+    {
+	for (k = kinds; k->name && strcmp(k->name, argv[j]); ++k);
+	if (!k->name) return usage(argv[0]);
+    }
+    if (outFile && argc - i != 1) return usage(argv[0]);
+
+    if (inFile)
+    {
+	if (readCorpus(inFile, &c)) return 1;
+	rc = run(inFile, c.text, c.len, rounds, 1, json);
+	free(c.text);
+	return rc;
+    }
+
+    for (k = kinds; k->name; ++k)
+    {
+	if (i < argc)
+	{
+	    for (j = i, selected = 0; j < argc; ++j)
+	    {
+		if (!strcmp(k->name, argv[j])) selected = 1;
+	    }
+	    if (!selected) continue;
+	}
+	c.len = 0;
+	k->generate(&c, count * k->scale);
+	if (outFile) rc |= writeCorpus(outFile, &c);
+	else rc |= run(k->name, c.text, c.len, rounds, k->serialize, json);
+    }
+    free(c.text);
+    return rc;
+}
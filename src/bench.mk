@@ -0,0 +1,8 @@
+P := src
+T := bench
+
+bench_SOURCES := bench.c
+bench_LIBS := $(LIBDIR)$(PSEP)libbadxml.a
+
+$(eval $(BINRULES))
+
@@ -5,52 +5,19 @@
 
 #include <badxml/badxml.h>
 
-char *readFile(const char *filename)
+XmlDoc *parseStdin(void)
 {
-    char *buffer;
-    FILE *file = 0;
-    size_t bufsize = 1024;
+    XmlPushParser *parser;
+    char buffer[16384];
     size_t readsize;
-    size_t readtotal;
 
-    if (filename)
+    /* feed standard input to the parser as it arrives */
+    parser = xmlPushParserNew(0, 0);
+    while ((readsize = fread(buffer, 1, sizeof buffer, stdin)) > 0)
     {
-	file = fopen(filename, "r");
-	if (!file)
-	{
-	    fprintf(stderr, "Cannot open `%s': %s\n",
-		    filename, strerror(errno));
-	    exit(1);
-	}
-    }
-    else file = stdin;
-
-    buffer = malloc(bufsize);
-    if (!buffer)
-    {
-	perror("malloc");
-	exit(1);
-    }
-
-    readtotal = 0;
-    while ((readsize = fread(buffer + readtotal, 1,
-		    bufsize - readtotal, file)) == bufsize - readtotal)
-    {
-        readtotal += readsize;
-        bufsize *= 2;
-        if (!(buffer = realloc(buffer, bufsize)))
-	{
-	    perror("realloc");
-	    exit(1);
-	}
+	if (xmlPushFeed(parser, buffer, readsize) != XML_SUCCESS) break;
     }
-
-    if (file != stdin) fclose(file);
-
-    readtotal += readsize;
-    buffer[readtotal] = 0;
-
-    return buffer;
+    return xmlPushFinish(parser);
 }
 
 int main(int argc, char **argv)
@@ -58,7 +25,7 @@ int main(int argc, char **argv)
     XmlDoc *doc;
     const XmlElement *element;
     const char *val;
-    char *xml;
+    XmlSink sink;
 
     if (argc < 4)
     {
@@ -66,12 +33,20 @@ int main(int argc, char **argv)
 		argv[0]);
         return 1;
     }
-    xml = readFile(argv[4]);
 
     /* parse the text and get an object tree */
-    doc = parseDoc(xml);
-
-    free(xml);
+    if (argv[4])
+    {
+	/* files are mapped and parsed directly */
+	doc = parseFile(argv[4]);
+	if (!doc)
+	{
+	    fprintf(stderr, "Cannot open `%s': %s\n",
+		    argv[4], strerror(errno));
+	    return 1;
+	}
+    }
+    else doc = parseStdin();
 
     if (xmlDocError(doc) != XML_SUCCESS)
     {
@@ -92,9 +67,10 @@ int main(int argc, char **argv)
     /* this is a no-op unless compiled with -DBADXML_DEBUG */
     dumpDoc(doc, stderr);
 
-    xml = xmlText(doc);
-    puts(xml);
-    free(xml);
+    /* write the document back to standard output */
+    xmlFileSink(&sink, stdout);
+    xmlWrite(doc, &sink, XML_WRITE_PRETTY);
+    putchar('\n');
 
     /* example: find an element matching tagname and attribute name and value */
     element = findMatching(rootElement(doc), argv[1], argv[2], argv[3]);
@@ -1,3 +1,4 @@
 include src$(PSEP)badxml$(PSEP)badxml.mk
 include src$(PSEP)example.mk
+include src$(PSEP)bench.mk
 